@@ -1,134 +1,324 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "epoch.h"
 #include "HashMap.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// Small maps keep their entries in the inline `small` array and are searched
+// linearly. Past HMAP_INLINE_CAP entries they switch to open addressing with
+// linear probing. The table capacity is always a power of two and the table
+// grows once it is more than 3/4 full, so probe sequences stay short
+// regardless of the number of entries. Each slot caches the full hash of its
+// key, which lets probing skip almost all of the `strcmp` calls.
+#define MIN_CAPACITY 8
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
 
-typedef struct Pair Pair;
+// A table that shrinks to MIN_CAPACITY with at most this many entries goes
+// back to the inline array. Kept below HMAP_INLINE_CAP for hysteresis.
+#define INLINE_RETURN (HMAP_INLINE_CAP / 2)
 
-struct Pair {
-    char* key;
+// Lookups and iteration may race with one writer (see HashMap.h), so every
+// field they read is accessed atomically. Keys and values are published with
+// release stores as readers follow them, everything else is relaxed. On common
+// hardware all of these are plain loads and stores.
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define LOAD_PTR(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_PTR(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+typedef struct Entry {
+    size_t hash;
+    const char* key; // NULL marks an empty slot.
     void* value;
-    Pair* next; // Next item in a single-linked list.
-};
+} Entry;
 
-struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
-    size_t size; // total number of entries in map.
+struct HashTable {
+    size_t capacity; // Number of slots, a power of two.
+    Entry entries[];
 };
 
-static unsigned int get_hash(const char* key);
+static size_t get_hash(const char* key, size_t len);
+
+void hmap_init(HashMap* map)
+{
+    memset(map, 0, sizeof(HashMap));
+}
+
+void hmap_destroy(HashMap* map)
+{
+    free(map->table);
+}
 
 HashMap* hmap_new()
 {
     HashMap* map = malloc(sizeof(HashMap));
     if (!map)
         return NULL;
-    memset(map, 0, sizeof(HashMap));
+    hmap_init(map);
     return map;
 }
 
 void hmap_free(HashMap* map)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
-        for (Pair* p = map->buckets[h]; p;) {
-            Pair* q = p;
-            p = p->next;
-            free(q->key);
-            free(q);
+    hmap_destroy(map);
+    free(map);
+}
+
+static void entry_set(Entry* e, size_t hash, const char* key, void* value)
+{
+    STORE(e->hash, hash);
+    STORE_PTR(e->value, value);
+    STORE_PTR(e->key, key);
+}
+
+// Return the slot holding `key` or, if it is absent, the empty slot ending its
+// probe sequence. Only for the writer.
+static Entry* table_find(HashTable* table, size_t h, const char* key)
+{
+    size_t mask = table->capacity - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        Entry* e = &table->entries[i];
+        if (!e->key || (e->hash == h && strcmp(key, e->key) == 0))
+            return e;
+    }
+}
+
+// Return the index of `key` in the inline array, or -1. Only for the writer.
+static int small_find(HashMap* map, const char* key)
+{
+    for (unsigned i = 0; i < map->size; ++i) {
+        if (strcmp(key, map->small[i].key) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Move all entries to a fresh table of `capacity` slots. Works in both modes.
+// The new table is filled before it is published and the old one is freed
+// only after concurrent readers are done with it.
+static bool hmap_resize(HashMap* map, size_t capacity)
+{
+    HashTable* old = map->table;
+    HashTable* table = calloc(1, sizeof(HashTable) + capacity * sizeof(Entry));
+    if (!table)
+        return false;
+    table->capacity = capacity;
+    if (!old) {
+        for (unsigned i = 0; i < map->size; ++i) {
+            const char* key = map->small[i].key;
+            size_t h = get_hash(key, strlen(key));
+            entry_set(table_find(table, h, key), h, key, map->small[i].value);
+        }
+    } else {
+        for (size_t i = 0; i < old->capacity; ++i) {
+            Entry* e = &old->entries[i];
+            if (e->key)
+                entry_set(table_find(table, e->hash, e->key), e->hash, e->key,
+                          e->value);
         }
     }
-    free(map);
+    STORE_PTR(map->table, table);
+    if (old)
+        epoch_defer_free(old);
+    return true;
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+// Go back from a table to the inline array.
+static void hmap_make_small(HashMap* map)
 {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
-            return p;
+    HashTable* table = map->table;
+    unsigned n = 0;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        Entry* e = &table->entries[i];
+        if (e->key) {
+            STORE_PTR(map->small[n].value, e->value);
+            STORE_PTR(map->small[n].key, e->key);
+            ++n;
+        }
     }
-    return NULL;
+    assert(n == map->size);
+    STORE_PTR(map->table, NULL);
+    epoch_defer_free(table);
+}
+
+// Whether a stored key equals the first `len` characters of `key`.
+static bool key_equal(const char* k, const char* key, size_t len)
+{
+    return strncmp(k, key, len) == 0 && k[len] == '\0';
 }
 
 void* hmap_get(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
-        return p->value;
-    else
+    return hmap_getn(map, key, strlen(key));
+}
+
+void* hmap_getn(HashMap* map, const char* key, size_t len)
+{
+    HashTable* table = LOAD_PTR(map->table);
+    if (!table) {
+        unsigned size = LOAD(map->size);
+        for (unsigned i = 0; i < size && i < HMAP_INLINE_CAP; ++i) {
+            const char* k = LOAD_PTR(map->small[i].key);
+            if (k && key_equal(k, key, len))
+                return LOAD_PTR(map->small[i].value);
+        }
         return NULL;
+    }
+    // Bounded by the capacity as a racing reader might never see an empty slot.
+    size_t h = get_hash(key, len);
+    size_t mask = table->capacity - 1;
+    for (size_t n = 0, i = h & mask; n <= mask; ++n, i = (i + 1) & mask) {
+        Entry* e = &table->entries[i];
+        const char* k = LOAD_PTR(e->key);
+        if (!k)
+            return NULL;
+        if (LOAD(e->hash) == h && key_equal(k, key, len))
+            return LOAD_PTR(e->value);
+    }
+    return NULL;
 }
 
 bool hmap_insert(HashMap* map, const char* key, void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
+    if (!map->table) {
+        if (small_find(map, key) >= 0)
+            return false; // Already exists.
+        if (map->size < HMAP_INLINE_CAP) {
+            STORE_PTR(map->small[map->size].value, value);
+            STORE_PTR(map->small[map->size].key, key);
+            STORE(map->size, map->size + 1);
+            return true;
+        }
+    }
+    size_t capacity = map->table ? map->table->capacity : 0;
+    size_t h = get_hash(key, strlen(key));
+    if ((map->size + 1) * MAX_LOAD_DEN > capacity * MAX_LOAD_NUM) {
+        if (!hmap_resize(map, capacity ? 2 * capacity : MIN_CAPACITY))
+            return false;
+    }
+    Entry* e = table_find(map->table, h, key);
+    if (e->key)
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
-    new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
-    map->size++;
+    entry_set(e, h, key, value);
+    STORE(map->size, map->size + 1);
     return true;
 }
 
-bool hmap_remove(HashMap* map, const char* key)
+bool hmap_remove_keep(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
-    while (*pp) {
-        Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
-            map->size--;
-            return true;
+    HashTable* table = map->table;
+    if (!table) {
+        int i = small_find(map, key);
+        if (i < 0)
+            return false;
+        unsigned last = map->size - 1;
+        STORE_PTR(map->small[i].value, map->small[last].value);
+        STORE_PTR(map->small[i].key, map->small[last].key);
+        STORE(map->size, last);
+        return true;
+    }
+    size_t mask = table->capacity - 1;
+    Entry* e = table_find(table, get_hash(key, strlen(key)), key);
+    if (!e->key)
+        return false;
+    STORE(map->size, map->size - 1);
+
+    // Backward shift deletion: pull later members of the probe run into the
+    // hole so that lookups never need tombstones.
+    size_t hole = e - table->entries;
+    for (size_t i = (hole + 1) & mask; table->entries[i].key; i = (i + 1) & mask) {
+        Entry* moved = &table->entries[i];
+        size_t home = moved->hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            entry_set(&table->entries[hole], moved->hash, moved->key,
+                      moved->value);
+            hole = i;
         }
-        pp = &(p->next);
     }
-    return false;
+    STORE_PTR(table->entries[hole].key, NULL);
+    return true;
+}
+
+bool hmap_remove(HashMap* map, const char* key)
+{
+    if (!hmap_remove_keep(map, key))
+        return false;
+    HashTable* table = map->table;
+    if (!table)
+        return true;
+
+    // Give memory back after mass removals. A failed shrink is harmless.
+    if (table->capacity == MIN_CAPACITY && map->size <= INLINE_RETURN)
+        hmap_make_small(map);
+    else if (table->capacity > MIN_CAPACITY && map->size * 8 < table->capacity)
+        hmap_resize(map, table->capacity / 2);
+    return true;
+}
+
+bool hmap_reserve(HashMap* map, size_t n)
+{
+    size_t capacity = map->table ? map->table->capacity : 0;
+    size_t needed = capacity ? capacity : MIN_CAPACITY;
+    if (!map->table && n <= HMAP_INLINE_CAP)
+        return true;
+    while (n * MAX_LOAD_DEN > needed * MAX_LOAD_NUM)
+        needed *= 2;
+    return needed == capacity || hmap_resize(map, needed);
 }
 
 size_t hmap_size(HashMap* map)
 {
-    return map->size;
+    return LOAD(map->size);
 }
 
 HashMapIterator hmap_iterator(HashMap* map)
 {
-    HashMapIterator it = { 0, map->buckets[0] };
+    (void)map;
+    HashMapIterator it = { 0 };
     return it;
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
-    Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
-        p = map->buckets[++it->bucket];
-    }
-    if (!p)
+    HashTable* table = LOAD_PTR(map->table);
+    const char* k;
+    if (!table) {
+        for (; it->slot < LOAD(map->size) && it->slot < HMAP_INLINE_CAP;) {
+            k = LOAD_PTR(map->small[it->slot].key);
+            if (k) {
+                *key = k;
+                *value = LOAD_PTR(map->small[it->slot].value);
+                ++it->slot;
+                return true;
+            }
+            ++it->slot;
+        }
         return false;
-    *key = p->key;
-    *value = p->value;
-    it->pair = p->next;
-    return true;
+    }
+    for (; it->slot < table->capacity; ++it->slot) {
+        k = LOAD_PTR(table->entries[it->slot].key);
+        if (k) {
+            *key = k;
+            *value = LOAD_PTR(table->entries[it->slot].value);
+            ++it->slot;
+            return true;
+        }
+    }
+    return false;
 }
 
-static unsigned int get_hash(const char* key)
+// 64-bit FNV-1a of the first `len` characters.
+static size_t get_hash(const char* key, size_t len)
 {
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
     }
-    return hash % N_BUCKETS;
+    return (size_t)hash;
 }
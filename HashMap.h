@@ -12,26 +12,58 @@ typedef struct HashMap HashMap;
 // Create a new, empty map.
 HashMap* hmap_new();
 
-// Clear the map and free its memory. This frees the map and the keys
-// copied by hmap_insert, but does not free any values.
+// Clear the map and free its memory. This frees the map, but does not free
+// any keys or values.
 void hmap_free(HashMap* map);
 
+// Initialise an empty map in caller-provided storage, eg. embedded in another
+// structure. Such a map is cleared with `hmap_destroy`, not `hmap_free`.
+void hmap_init(HashMap* map);
+
+// Clear a map set up with `hmap_init`. Frees any table memory but neither the
+// keys, the values nor the `HashMap` itself.
+void hmap_destroy(HashMap* map);
+
 // Get the value stored under `key`, or NULL if not present.
 void* hmap_get(HashMap* map, const char* key);
 
+// Like `hmap_get`, but the key is the first `len` characters of `key`, which
+// need not be null-terminated.
+void* hmap_getn(HashMap* map, const char* key, size_t len);
+
 // Insert a `value` under `key` and return true,
-// or do nothing and return false if `key` already exists in the map.
+// or do nothing and return false if `key` already exists in the map
+// (or if memory for it could not be allocated).
 // `value` must not be NULL.
-// (The caller can free `key` at any time - the map internally uses a copy of it).
+// The map does not copy `key`, it borrows it: the string must stay valid and
+// unchanged until it is removed from the map (or the map is cleared).
 bool hmap_insert(HashMap* map, const char* key, void* value);
 
 // Remove the value under `key` and return true (the value is not free'd),
 // or do nothing and return false if `key` was not present.
 bool hmap_remove(HashMap* map, const char* key);
 
+// Like `hmap_remove`, but never gives memory back: it neither allocates nor
+// rehashes, and a following insert still cannot fail after `hmap_reserve`.
+bool hmap_remove_keep(HashMap* map, const char* key);
+
+// Make room for `n` entries in total, so that inserting up to that many does
+// not allocate and cannot fail, nor can removing one and inserting one back.
+// Returns false if memory could not be allocated.
+bool hmap_reserve(HashMap* map, size_t n);
+
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Concurrent readers:
+// `hmap_get`, `hmap_size` and iteration may run concurrently with a single
+// thread modifying the map. They never crash or loop forever, but they may
+// see an inconsistent state, so their results are only good if the caller
+// can tell that no modification overlapped them (eg. with a `Seq` from
+// epoch.h). Such readers must be in an epoch read section: the map gives
+// memory back with `epoch_defer_free`, and the keys and values must be
+// reclaimed in the same way.
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
@@ -43,6 +75,7 @@ HashMapIterator hmap_iterator(HashMap* map);
 // returns false.
 //
 // The map cannot be modified between calls to `hmap_iterator` and `hmap_next`.
+// (Except for the concurrent readers described above.)
 //
 // Usage: ```
 //     const char* key;
@@ -55,8 +88,24 @@ bool hmap_next(HashMap* map, HashMapIterator* it, const char** key,
                void** value);
 
 struct HashMapIterator {
-  int bucket;
-  void* pair;
+  size_t slot;
+};
+
+// Up to this many entries are kept inline in the map and searched linearly,
+// so small maps need no allocation besides their keys.
+#define HMAP_INLINE_CAP 4
+
+typedef struct HashTable HashTable;
+
+// The definition is public only so that maps can be embedded by value.
+// Do not access the fields directly.
+struct HashMap {
+  unsigned size; // total number of entries in map.
+  HashTable* table; // Used instead of `small` when not NULL.
+  struct {
+    const char* key;
+    void* value;
+  } small[HMAP_INLINE_CAP];
 };
 
 #endif  /* _HASH_MAP_H_ */
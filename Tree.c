@@ -3,22 +3,48 @@
  * operations on a direcotry tree like structure.
  */
 
+#include <stdalign.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "err.h"
 #include "HashMap.h"
+#include "arena.h"
+#include "epoch.h"
 #include "path_utils.h"
 #include "rw.h"
+#include "wal.h"
 #include "Tree.h"
 
 /** This is the root directory name. */
 #define ROOT_PATH "/"
 
+/** Lockless tries of `tree_list` before it takes the locks instead. */
+#define LIST_ATTEMPTS 8
+
+/** Lockless tries of `pin_child` before it takes the parent's lock instead. */
+#define PIN_ATTEMPTS 8
+
+/** Slots of a tree's path cache, a power of two. */
+#define CACHE_SLOTS 4096
+
+/** Shallower paths are quicker to walk than to look up, they are not cached. */
+#define CACHE_MIN_DEPTH 4
+
+/** Number of path cache counter stripes, threads are spread over them. */
+#define CACHE_STRIPES 16
+
 /**
  * A macro for centralised function exiting with an error code. It assumes that
  * there is an `int err` declared previously and a label `exiting` at which it
@@ -30,278 +56,2762 @@
     goto exiting;                               \
   } while(0)
 
-/**
- * This is a recursive data structure representing a directory tree. It keeps
- * a r&w monitor for access protection.
- */
-struct Tree {
-  Monitor mon;
-  char* dir_name;
-  HashMap* subdirs;
-};
+/**
+ * A rendered `tree_list` result of a directory. It is only good while the
+ * directory's sequence counter still reads `seq`.
+ *
+ * The i-th name of `contents` starts at `start[i]` and ends one before
+ * `start[i + 1]`, with `start[count]` being one past the end of `contents`.
+ * The names are sorted, so they can be searched without looking at the map.
+ */
+typedef struct Listing {
+  uint32_t seq;
+  size_t count;
+  char* contents;
+  size_t start[];
+} Listing;
+
+/**
+ * Children of a directory as they were before it got changed, kept for the
+ * snapshots taken earlier (see `tree_snapshot`). The i-th child is called like
+ * the i-th name of `listing`.
+ *
+ * A version is saved right before the first change after a snapshot and
+ * tagged with the id of the last snapshot then, so it is what the snapshots
+ * with ids up to `tag` see, down to the tag of the next (older) version.
+ */
+typedef struct Version {
+  uint64_t tag;
+  _Atomic(struct Version*) next;
+  Listing* listing;
+  struct Dir* dirs[];
+} Version;
+
+/**
+ * This is a recursive data structure representing a directory tree. It keeps
+ * a r&w monitor for access protection.
+ *
+ * Nodes live in their tree's arena. The name is allocated from the arena too
+ * and comes first as the arena reuses the first word of released nodes. It is
+ * the only copy of the name: the parent's map borrows it as the key. The
+ * monitor, the map and the sequence counter stay initialised while a node sits
+ * in the arena.
+ *
+ * Paths are walked without locking (see `pin_child` and `tree_list`), so each
+ * change of a map is wrapped in its dir's `seq` and unlinked nodes are retired
+ * through the epoch rather than released right away.
+ *
+ * The last listing of a directory is kept so that listing it again only takes
+ * a copy. Changing the map drops it, listings are retired through the epoch as
+ * well.
+ */
+typedef struct Dir {
+  char* dir_name;
+  Monitor mon;
+  /* operations in progress at this directory or anywhere below it */
+  Pins pins;
+  Seq seq;
+  HashMap subdirs;
+  /* NULL if not listed since the last change */
+  _Atomic(Listing*) listing;
+  /* newest first, NULL if no snapshot needs any */
+  _Atomic(Version*) versions;
+  /* the tag of the last version saved, only for the writer */
+  uint64_t saved;
+  /* written around every detaching of this very directory, never reset */
+  Seq detached;
+} Dir;
+
+/** A removed subtree some snapshot may still see. */
+typedef struct Parked {
+  Dir* dir;
+  /* the last snapshot taken before it was removed */
+  uint64_t id;
+  struct Parked* next;
+} Parked;
+
+/**
+ * A path resolved earlier: the directories its first `depth` components lead
+ * through, the root first, and what their `detached` counters read then. For
+ * as long as none of them gets detached the path still leads there, so it can
+ * be checked without looking at any map. Moving or removing any of them makes
+ * the entry stale for good, as the counters are never reset, not even when
+ * a node is reused.
+ *
+ * Entries never change. A new one replaces the entry in its slot and the old
+ * one is retired through the epoch, so lookups only enter a read section.
+ */
+typedef struct CacheEntry {
+  size_t hash;
+  size_t depth;
+  /* the first `len` characters of the path, not terminated */
+  size_t len;
+  const char* path;
+  const uint32_t* gens;
+  Dir* dirs[];
+} CacheEntry;
+
+/** How the path cache has done, striped so that lookups do not share lines. */
+typedef struct CacheCounters {
+  alignas(64) atomic_ulong hits;
+  atomic_ulong misses;
+  atomic_ulong invalidations;
+} CacheCounters;
+
+/** Direct mapped cache of deep paths, see `cache_find`. */
+typedef struct PathCache {
+  CacheCounters counters[CACHE_STRIPES];
+  _Atomic(CacheEntry*) slots[CACHE_SLOTS];
+} PathCache;
+
+/**
+ * The tree itself: its root directory and the arena all of its nodes use.
+ *
+ * A snapshot is a tree of its own sharing all of that with its `origin`, the
+ * rest is kept by the origin only. Snapshots get increasing ids, the versions
+ * of directories are saved and removed subtrees are parked for as long as
+ * some snapshot with a low enough id is there.
+ */
+struct Tree {
+  Dir* root;
+  Arena* arena;
+  /* NULL if this is not a snapshot */
+  Tree* origin;
+  uint64_t snapshot_id;
+  /* 0 before the first one */
+  _Atomic(uint64_t) last_snapshot;
+  /* UINT64_MAX if there are none */
+  _Atomic(uint64_t) oldest_snapshot;
+  /* guards the ids of snapshots there are and the parked subtrees */
+  pthread_mutex_t snapshot_lock;
+  uint64_t* snapshots;
+  size_t snapshot_count;
+  size_t snapshot_size;
+  Parked* parked;
+  /* NULL if changes are not logged, see `log_change` */
+  Wal* wal;
+  bool wal_sync;
+  PathCache* cache;
+};
+
+/** Free a list of versions, with the arguments of an `epoch_retire` callback. */
+static void release_versions(void* obj, void* arg)
+{
+  Version* version = obj;
+  Version* next;
+
+  (void)arg;
+
+  for (; version; version = next) {
+    next = atomic_load_explicit(&version->next, memory_order_relaxed);
+    free(version->listing);
+    free(version);
+  }
+}
+
+/** Arena constructor of a `Dir`. */
+static int dir_ctor(void* obj)
+{
+  Dir* dir = obj;
+  int err = monit_init(&dir->mon);
+
+  if (!err) {
+    pins_init(&dir->pins);
+    seq_init(&dir->seq);
+    seq_init(&dir->detached);
+    hmap_init(&dir->subdirs);
+    atomic_init(&dir->listing, NULL);
+    atomic_init(&dir->versions, NULL);
+    dir->saved = 0;
+  }
+
+  return err;
+}
+
+/** Arena destructor of a `Dir`, whatever state it is in. */
+static void dir_dtor(void* obj)
+{
+  Dir* dir = obj;
+
+  monit_destroy(&dir->mon);
+  hmap_destroy(&dir->subdirs);
+  free(atomic_load(&dir->listing));
+  release_versions(atomic_load(&dir->versions), NULL);
+}
+
+/**
+ * A helper function for creating a new empty directory with a given name in
+ * the tree's arena. Copies the first `len` characters of dname.
+ */
+static Dir* new_dir(Tree* tree, const char* dname, size_t len)
+{
+  Dir* dir = arena_alloc(tree->arena);
+
+  if (!dir)
+    return NULL;
+
+  dir->dir_name = arena_strndup(tree->arena, dname, len);
+
+  if (!dir->dir_name) {
+    arena_release(tree->arena, dir);
+    return NULL;
+  }
+
+  return dir;
+}
+
+/** `free_dir` with the arguments of an `epoch_retire` callback. */
+static void release_dir(void* obj, void* arena)
+{
+  Dir* dir = obj;
+
+  /* keep the map constructed but drop its table if it had one */
+  hmap_destroy(&dir->subdirs);
+  hmap_init(&dir->subdirs);
+  free(atomic_exchange(&dir->listing, NULL));
+  release_versions(atomic_exchange(&dir->versions, NULL), NULL);
+  dir->saved = 0;
+  arena_str_release(arena, dir->dir_name);
+  arena_release(arena, dir);
+}
+
+/** `arena_str_release` with the arguments of an `epoch_retire` callback. */
+static void release_name(void* name, void* arena)
+{
+  arena_str_release(arena, name);
+}
+
+/** Release a name once the lockless readers that may compare with it are gone. */
+static void retire_name(Tree* tree, char* name)
+{
+  epoch_retire(name, release_name, tree->arena);
+}
+
+/**
+ * Give a single directory back to the arena. Its subdirectories must have been
+ * moved elsewhere or freed already and no lockless reader may know about it,
+ * see `retire_subtree` otherwise.
+ */
+static void free_dir(Tree* tree, Dir* dir)
+{
+  release_dir(dir, tree->arena);
+}
+
+/**
+ * Forget the listing of a directory whose map is being changed. Must be called
+ * within the `seq` write section of the change.
+ */
+static void drop_listing(Dir* dir)
+{
+  Listing* listing = atomic_exchange(&dir->listing, NULL);
+
+  if (listing)
+    epoch_defer_free(listing);
+}
+
+/**
+ * Render the children of a directory into a new listing for `seq`, NULL if
+ * out of memory.
+ */
+static Listing* new_listing(HashMap* subdirs, uint32_t seq)
+{
+  const char** names = make_map_contents_array(subdirs);
+  Listing* listing;
+  size_t count = 0;
+  size_t len = 0;
+  size_t name_len;
+
+  if (!names)
+    return NULL;
+
+  for (; names[count]; ++count)
+    len += strlen(names[count]) + 1;
+
+  /* room for the terminating null even if there are no names */
+  listing = malloc(sizeof(Listing) + (count + 1) * sizeof(size_t) + len + 1);
+
+  if (!listing) {
+    free(names);
+    return NULL;
+  }
+
+  listing->seq = seq;
+  listing->count = count;
+  listing->contents = (char*)&listing->start[count + 1];
+  listing->start[0] = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    name_len = strlen(names[i]);
+    memcpy(listing->contents + listing->start[i], names[i], name_len);
+    listing->contents[listing->start[i] + name_len] = ',';
+    listing->start[i + 1] = listing->start[i] + name_len + 1;
+  }
+
+  /* the last comma goes */
+  listing->contents[count ? len - 1 : 0] = '\0';
+  free(names);
+  return listing;
+}
+
+/** Length of a listing's `contents`. */
+static size_t listing_len(const Listing* listing)
+{
+  return listing->count ? listing->start[listing->count] - 1 : 0;
+}
+
+/**
+ * Get a listing of a directory whose sequence counter read `seq` from within a
+ * read section. A kept listing for `seq` is returned as it is, otherwise the
+ * map gets rendered and the result kept for the next time. In that case
+ * `*owned` may be set: the listing could not be kept and has to be freed by
+ * the caller. The caller still has to check that `seq` has not moved if the
+ * directory is not locked.
+ */
+static Listing* get_listing(Dir* dir, uint32_t seq, bool* owned)
+{
+  Listing* listing = atomic_load_explicit(&dir->listing, memory_order_acquire);
+  Listing* fresh;
+
+  *owned = false;
+
+  if (listing && listing->seq == seq)
+    return listing;
+
+  fresh = new_listing(&dir->subdirs, seq);
+
+  if (!fresh)
+    exit(1);
+
+  /* not worth keeping if it is already out of date, a racing writer could not
+   * drop it */
+  if (!seq_read_valid(&dir->seq, seq)) {
+    *owned = true;
+    return fresh;
+  }
+
+  /* a stale listing is replaced, a concurrent lister may beat us to it */
+  if (atomic_compare_exchange_strong(&dir->listing, &listing, fresh)) {
+    if (listing)
+      epoch_defer_free(listing);
+  } else {
+    *owned = true;
+  }
+
+  return fresh;
+}
+
+/**
+ * The id the versions saved for a change get, see `save_version`. It is read
+ * once per change after the `seq` write sections of all the directories the
+ * change touches have begun: a snapshot taken after that waits for the whole
+ * change and sees it, the ones up to the id see none of it. Reading it for
+ * each directory apart could split a move between two snapshots.
+ */
+static uint64_t change_id(Tree* tree)
+{
+  return atomic_load(&tree->last_snapshot);
+}
+
+/**
+ * Keep the children of a directory that is about to be changed for the
+ * snapshots up to `id`, the `change_id` of the change, if there are any left.
+ * Must be called within the `seq` write section of the change, after it has
+ * begun. Versions that no snapshot is going to look at anymore are dropped.
+ * Returns false if out of memory, then the change must not be made: the
+ * directory as it is stays right for the snapshots.
+ */
+static bool save_version(Tree* tree, Dir* dir, uint64_t id)
+{
+  uint64_t oldest = atomic_load(&tree->oldest_snapshot);
+  _Atomic(Version*)* link = &dir->versions;
+  Version* version;
+  Listing* listing;
+  size_t len;
+
+  while ((version = atomic_load_explicit(link, memory_order_relaxed)) &&
+         version->tag >= oldest)
+    link = &version->next;
+
+  /* lockless readers may still be going down the list */
+  if (version) {
+    atomic_store_explicit(link, NULL, memory_order_relaxed);
+    epoch_retire(version, release_versions, NULL);
+  }
+
+  if (id == dir->saved || id < oldest)
+    return true;
+
+  listing = new_listing(&dir->subdirs, 0);
+
+  if (!listing)
+    return false;
+
+  version = malloc(sizeof(Version) + listing->count * sizeof(Dir*));
+
+  if (!version) {
+    free(listing);
+    return false;
+  }
+
+  version->tag = id;
+  version->listing = listing;
+
+  for (size_t i = 0; i < listing->count; ++i) {
+    len = listing->start[i + 1] - listing->start[i] - 1;
+    version->dirs[i] = hmap_getn(&dir->subdirs,
+                                 listing->contents + listing->start[i], len);
+  }
+
+  atomic_init(&version->next,
+              atomic_load_explicit(&dir->versions, memory_order_relaxed));
+  atomic_store_explicit(&dir->versions, version, memory_order_release);
+  dir->saved = id;
+  return true;
+}
+
+/**
+ * The version of a directory the snapshot `id` sees, from within a read
+ * section. NULL if there is none, then it sees the directory as it is.
+ */
+static Version* version_for(Dir* dir, uint64_t id)
+{
+  Version* version = atomic_load_explicit(&dir->versions,
+                                          memory_order_acquire);
+  Version* found = NULL;
+
+  for (; version && version->tag >= id;
+       version = atomic_load_explicit(&version->next, memory_order_acquire))
+    found = version;
+
+  return found;
+}
+
+/** The child of a version called like the first `len` characters of `name`. */
+static Dir* version_child(const Version* version, const char* name, size_t len)
+{
+  const Listing* listing = version->listing;
+  size_t lo = 0;
+  size_t hi = listing->count;
+  size_t mid;
+  size_t mid_len;
+  int cmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    mid_len = listing->start[mid + 1] - listing->start[mid] - 1;
+    cmp = memcmp(listing->contents + listing->start[mid], name,
+                 mid_len < len ? mid_len : len);
+
+    if (!cmp)
+      cmp = (mid_len > len) - (mid_len < len);
+
+    if (!cmp)
+      return version->dirs[mid];
+    else if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return NULL;
+}
+
+/** A directory `release_subtree` is in the middle of. */
+typedef struct Release {
+  Dir* dir;
+  HashMapIterator it;
+} Release;
+
+/**
+ * `free_dir` for a whole subtree with the arguments of an `epoch_retire`
+ * callback. It goes depth first with a stack of its own as a subtree can be
+ * deeper than any path.
+ */
+static void release_subtree(void* obj, void* arena)
+{
+  Release* stack = NULL;
+  size_t depth = 0;
+  size_t size = 0;
+  const char* name;
+  void* child = obj;
+
+  while (child) {
+    if (depth == size) {
+      size = size ? 2 * size : 64;
+      stack = realloc(stack, size * sizeof(Release));
+
+      if (!stack)
+        exit(1);
+    }
+
+    stack[depth].dir = child;
+    stack[depth++].it = hmap_iterator(&((Dir*)child)->subdirs);
+    child = NULL;
+
+    /* children go before their parent, whose map is being iterated */
+    while (depth && !hmap_next(&stack[depth - 1].dir->subdirs,
+                               &stack[depth - 1].it, &name, &child))
+      release_dir(stack[--depth].dir, arena);
+  }
+
+  free(stack);
+}
+
+/**
+ * Free a detached subtree once the lockless readers that may still be inside
+ * are gone. It is reclaimed in one go by whoever reclaims next, which is never
+ * under any of the tree's locks. If a snapshot up to `id`, the `change_id` of
+ * the removal, is still there, it is parked until the last such snapshot is
+ * freed instead. Without memory to park it it is kept until the arena goes
+ * along with the tree.
+ */
+static void retire_subtree(Tree* tree, Dir* dir, uint64_t id)
+{
+  Parked* parked;
+  bool seen;
+  int err;
+
+  err = pthread_mutex_lock(&tree->snapshot_lock);
+  syserr(err, "retire subtree, mutex lock");
+  seen = atomic_load(&tree->oldest_snapshot) <= id;
+
+  parked = seen ? malloc(sizeof(Parked)) : NULL;
+
+  if (parked) {
+    parked->dir = dir;
+    parked->id = id;
+    parked->next = tree->parked;
+    tree->parked = parked;
+  }
+
+  err = pthread_mutex_unlock(&tree->snapshot_lock);
+  syserr(err, "retire subtree, mutex unlock");
+
+  if (!seen)
+    epoch_retire(dir, release_subtree, tree->arena);
+}
+
+/** Pin a directory and remember it in `pinned` for `unpin_dirs`. */
+static void pin_dir(Dir* dir, Dir* pinned[], size_t* pinned_count)
+{
+  pin(&dir->pins);
+  pinned[(*pinned_count)++] = dir;
+}
+
+/** Unpin everything `pin_dir` has pinned. */
+static void unpin_dirs(Dir* pinned[], size_t count)
+{
+  for (; count --> 0; )
+    unpin(&pinned[count]->pins);
+}
+
+/**
+ * Find the child of a pinned directory `dir` called like the first `len`
+ * characters of `name` and pin it. The child is saved under `child`, NULL if
+ * there is none. Returns some errno.
+ *
+ * Nothing gets locked or entered: the child is looked up and pinned
+ * optimistically and kept only if `dir`'s map has not changed meanwhile. Since
+ * those who detach a directory bump its `detached` counter before draining its
+ * pins, either they wait for our pin or we see the counter odd and back off.
+ * The pinned parent itself cannot be detached in the meantime. A writer in the
+ * middle of changing `dir` counts as a failed try, and only after a few of
+ * those the parent's lock is taken to do the same, so nobody spins for long.
+ *
+ * With `try` set it never waits for anybody. Instead of waiting for a writer
+ * of `dir` or taking its lock it returns EBUSY.
+ */
+static int pin_child(Dir* dir, const char* name, size_t len, bool try,
+                     Dir** child)
+{
+  uint32_t start;
+  uint32_t gen;
+  unsigned token;
+  bool valid;
+  int err;
+
+  for (int i = 0; i < PIN_ATTEMPTS; ++i) {
+    /* the child may be retired under our hands, it must not be released
+     * until we are done touching it */
+    token = epoch_enter();
+    valid = seq_read_try(&dir->seq, &start);
+
+    if (valid) {
+      *child = hmap_getn(&dir->subdirs, name, len);
+
+      if (*child)
+        pin(&(*child)->pins);
+
+      /* the child's counter before the parent's: a detach that has ended
+       * moved the parent's one before */
+      atomic_thread_fence(memory_order_seq_cst);
+      valid = (!*child || seq_read_try(&(*child)->detached, &gen)) &&
+              seq_read_valid(&dir->seq, start);
+
+      if (!valid && *child)
+        unpin(&(*child)->pins);
+    }
+
+    epoch_exit(token);
+
+    if (valid)
+      return 0;
+
+    sched_yield();
+  }
+
+  *child = NULL;
+
+  if (try)
+    return EBUSY;
+
+  err = reader_entry(&dir->mon);
+  syserr(err, "pin_child: Failed to enter a monitor");
+  *child = hmap_getn(&dir->subdirs, name, len);
+
+  if (*child)
+    pin(&(*child)->pins);
+
+  err = reader_exit(&dir->mon);
+  syserr(err, "pin_child: Failed to exit a monitor");
+
+  return 0;
+}
+
+/**
+ * Walk down from a pinned directory `from` along the components `begin` to
+ * `end` (exclusive) of a `path`, `from` being where the first `begin` of them
+ * lead. Every directory on the way gets pinned with `pin_child` (`try` is
+ * passed on).
+ * Nothing is entered, so walks do not write to the monitors of the directories
+ * near the root. The destination is saved under `dest`, NULL if it does not
+ * exist. Returns some errno.
+ *
+ * The pinned directories are saved in `pinned`, whose size is kept under
+ * `pinned_count`. Unpinning them is up to the caller, also on error, after they
+ * are done with the destination.
+ */
+static int walk(Dir* from, const PathView* path, size_t begin, size_t end,
+                bool try, Dir** dest, Dir* pinned[], size_t* pinned_count)
+{
+  const char* name;
+  size_t len;
+  int err;
+
+  *dest = from;
+
+  for (size_t i = begin; *dest && i < end; ++i) {
+    name = path_component(path, i, &len);
+    err = pin_child(*dest, name, len, try, dest);
+
+    if (err)
+      return err;
+
+    if (*dest)
+      pinned[(*pinned_count)++] = *dest;
+  }
+
+  return 0;
+}
+
+/** Round-robin source of cache counter stripes for new threads. */
+static atomic_uint next_cache_stripe;
+
+/** This thread's cache counter stripe plus one, zero if not chosen yet. */
+static _Thread_local unsigned cache_stripe;
+
+/** This thread's stripe of the tree's cache counters. */
+static CacheCounters* cache_counters(Tree* tree)
+{
+  if (!cache_stripe)
+    cache_stripe = atomic_fetch_add(&next_cache_stripe, 1) % CACHE_STRIPES + 1;
+
+  return &tree->cache->counters[cache_stripe - 1];
+}
+
+/** Add one to a cache counter, nobody orders anything by them. */
+static void cache_count(atomic_ulong* counter)
+{
+  atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+/** FNV-1a of the first `len` characters of a path. */
+static size_t path_hash(const char* path, size_t len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < len; ++i)
+    hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+
+  return hash;
+}
+
+/** Whether none of the directories of a cache entry has been detached since. */
+static bool cache_valid(const CacheEntry* entry)
+{
+  /* the root never is */
+  for (size_t i = 1; i <= entry->depth; ++i)
+    if (!seq_read_valid(&entry->dirs[i]->detached, entry->gens[i]))
+      return false;
+
+  return true;
+}
+
+/**
+ * Take a stale entry out of its slot, from within a read section, so that it
+ * fails no other lookup. Only the lookup that takes it out counts the
+ * invalidation. Returns the entry if that is us, it is up to the caller to
+ * retire it once out of the read section.
+ */
+static CacheEntry* cache_evict(Tree* tree, CacheEntry* entry)
+{
+  _Atomic(CacheEntry*)* slot =
+      &tree->cache->slots[entry->hash & (CACHE_SLOTS - 1)];
+
+  if (!atomic_compare_exchange_strong(slot, &entry, NULL))
+    return NULL;
+
+  cache_count(&cache_counters(tree)->invalidations);
+  return entry;
+}
+
+/**
+ * Look the first `depth` components of a `path` up in the tree's cache, from
+ * within a read section. Returns the entry if it is there and still good, NULL
+ * otherwise, counting a miss. A stale entry is evicted, see `cache_evict`.
+ * Whoever goes on using the entry has to check it with `cache_valid` again
+ * after and count the hit.
+ */
+static CacheEntry* cache_find(Tree* tree, const PathView* path, size_t depth,
+                              CacheEntry** evicted)
+{
+  size_t len = path->start[depth];
+  size_t hash;
+  CacheEntry* entry;
+
+  if (depth < CACHE_MIN_DEPTH)
+    return NULL;
+
+  hash = path_hash(path->path, len);
+  entry = atomic_load_explicit(&tree->cache->slots[hash & (CACHE_SLOTS - 1)],
+                               memory_order_acquire);
+
+  if (!entry || entry->hash != hash || entry->len != len ||
+      memcmp(entry->path, path->path, len) != 0) {
+    cache_count(&cache_counters(tree)->misses);
+    return NULL;
+  }
+
+  if (!cache_valid(entry)) {
+    *evicted = cache_evict(tree, entry);
+    return NULL;
+  }
+
+  return entry;
+}
+
+/**
+ * Make a cache entry for the first `depth` components of a `path` leading
+ * through `dirs`, the root first. The caller must make sure that the path is
+ * still there after this reads the counters: either the directories are pinned
+ * or the walk is validated afterwards. Returns NULL if the path is too short
+ * to be cached, one of the directories is being detached right now or there is
+ * no memory, the cache does without.
+ */
+static CacheEntry* cache_new(const PathView* path, size_t depth,
+                             Dir* const dirs[])
+{
+  size_t len = path->start[depth];
+  CacheEntry* entry;
+  uint32_t* gens;
+  char* copy;
+
+  if (depth < CACHE_MIN_DEPTH)
+    return NULL;
+
+  entry = malloc(sizeof(CacheEntry) +
+                 (depth + 1) * (sizeof(Dir*) + sizeof(uint32_t)) + len);
+
+  if (!entry)
+    return NULL;
+
+  gens = (uint32_t*)(entry->dirs + depth + 1);
+  copy = (char*)(gens + depth + 1);
+
+  for (size_t i = 0; i <= depth; ++i) {
+    entry->dirs[i] = dirs[i];
+
+    if (!seq_read_try(&dirs[i]->detached, &gens[i])) {
+      free(entry);
+      return NULL;
+    }
+  }
+
+  memcpy(copy, path->path, len);
+  entry->hash = path_hash(path->path, len);
+  entry->depth = depth;
+  entry->len = len;
+  entry->path = copy;
+  entry->gens = gens;
+  return entry;
+}
+
+/** Put a new entry in its slot of the cache, in place of whatever was there.
+ * Not from within a read section. */
+static void cache_publish(Tree* tree, CacheEntry* entry)
+{
+  CacheEntry* old = atomic_exchange_explicit(
+      &tree->cache->slots[entry->hash & (CACHE_SLOTS - 1)], entry,
+      memory_order_acq_rel);
+
+  /* lookups may still be comparing against it */
+  if (old)
+    epoch_defer_free(old);
+}
+
+/**
+ * Find the directory the first `depth` components of a `path` lead to in the
+ * cache and pin the whole path to it like `walk` would. Returns it, NULL if it
+ * has to be walked to instead.
+ *
+ * Those who detach a directory bump its `detached` counter before draining its
+ * pins, so once the path is pinned either they wait for us or we see one of
+ * the counters moved and back off, much like in `pin_child`.
+ */
+static Dir* cache_pin(Tree* tree, const PathView* path, size_t depth,
+                      Dir* pinned[], size_t* pinned_count)
+{
+  unsigned token = epoch_enter();
+  CacheEntry* evicted = NULL;
+  CacheEntry* entry = cache_find(tree, path, depth, &evicted);
+  Dir* dir = NULL;
+
+  if (entry) {
+    for (size_t i = 0; i <= depth; ++i)
+      pin_dir(entry->dirs[i], pinned, pinned_count);
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (cache_valid(entry)) {
+      dir = entry->dirs[depth];
+      cache_count(&cache_counters(tree)->hits);
+    } else {
+      unpin_dirs(pinned, *pinned_count);
+      *pinned_count = 0;
+      evicted = cache_evict(tree, entry);
+    }
+  }
+
+  epoch_exit(token);
+
+  if (evicted)
+    epoch_defer_free(evicted);
+
+  return dir;
+}
+
+/**
+ * Find the directory the first `depth` components of a `path` lead to from the
+ * root and enter it with `entry_fn`, which is either `reader_entry` or
+ * `writer_entry`. The result is saved under `dest` and is NULL if the directory
+ * does not exist, returns some errno. The pins are saved like in `walk`, the
+ * root's included.
+ *
+ * Deep paths are looked up in the cache first and cached once walked.
+ */
+static int access_dir(Tree* tree, const PathView* path, size_t depth,
+                      Dir** dest, int entry_fn(Monitor*), Dir* pinned[],
+                      size_t* pinned_count)
+{
+  CacheEntry* entry;
+  Dir* dir;
+  int err;
+
+  *pinned_count = 0;
+  *dest = NULL;
+  dir = cache_pin(tree, path, depth, pinned, pinned_count);
+
+  if (!dir) {
+    pin_dir(tree->root, pinned, pinned_count);
+    err = walk(tree->root, path, 0, depth, false, &dir, pinned, pinned_count);
+
+    if (err || !dir)
+      return err;
+
+    /* a detach may begin but cannot end while the path is pinned */
+    entry = cache_new(path, depth, pinned);
+
+    if (entry)
+      cache_publish(tree, entry);
+  }
+
+  err = entry_fn(&dir->mon);
+
+  if (!err)
+    *dest = dir;
+
+  return err;
+}
+
+/**
+ * Take hold of two directories simultaneously. This bears some resemblance to
+ * the classic hungry philosophers problem where philosophers require posessing
+ * two forks. In this analogy those are two directories (eg. in `tree_move`).
+ * Naïve sequential taking of the two forks one by one won't work as we may
+ * starve ourselves with a fellow philosopher.
+ *
+ * Solution: number the forks and never wait for the second one. The directory
+ * whose path comes first in lexicographic order, so ancestors before their
+ * descendants, is write locked first like any other operation does it: with
+ * only its own path pinned. Then the other one is walked to and locked with
+ * `try` and if anybody is in the way we let everything go and start over.
+ * That way we do not wait for a lock while pinning something outside of it,
+ * which could deadlock with a mover that holds that lock and waits for our
+ * pins to drain.
+ *
+ * Nothing above the two directories is locked, the pins on the common path
+ * act as intention locks: nothing up there can be moved or removed while we
+ * are below, yet unrelated operations anywhere else go on. On success the
+ * caller has to exit `t1`, where the first `d1` components of `p1` lead, and
+ * `t2` for `d2` of `p2`, which may be the same directory. Both are NULL
+ * otherwise. The pins are saved like in `walk`.
+ */
+static int double_access(const PathView* p1, size_t d1, const PathView* p2,
+                         size_t d2, Dir* root, Dir** t1, Dir** t2,
+                         Dir* pinned[], size_t* pinned_count)
+{
+  size_t len1 = p1->start[d1];
+  size_t len2 = p2->start[d2];
+  int cmp = memcmp(p1->path, p2->path, len1 < len2 ? len1 : len2);
+  bool swap = cmp > 0 || (cmp == 0 && len1 > len2);
+  const PathView* first_path = swap ? p2 : p1;
+  const PathView* second_path = swap ? p1 : p2;
+  size_t first_depth = swap ? d2 : d1;
+  size_t second_depth = swap ? d1 : d2;
+  Dir** first = swap ? t2 : t1;
+  Dir** second = swap ? t1 : t2;
+  size_t lca_depth = 0;
+  Dir* lca;
+  int err;
+
+  /* the common components lead to the lca */
+  while (lca_depth < d1 && lca_depth < d2 &&
+         p1->start[lca_depth + 1] == p2->start[lca_depth + 1] &&
+         memcmp(p1->path + p1->start[lca_depth], p2->path + p2->start[lca_depth],
+                p1->start[lca_depth + 1] - p1->start[lca_depth]) == 0)
+    ++lca_depth;
+
+  *t1 = *t2 = NULL;
+  *pinned_count = 0;
+
+  for (;;) {
+    pin_dir(root, pinned, pinned_count);
+    err = walk(root, p1, 0, lca_depth, false, &lca, pinned, pinned_count);
+
+    if (err || !lca)
+      break;
+
+    err = walk(lca, first_path, lca_depth, first_depth, false, first, pinned,
+               pinned_count);
+
+    if (err || !*first)
+      break;
+
+    err = writer_entry(&(*first)->mon);
+
+    if (err) {
+      *first = NULL;
+      break;
+    }
+
+    err = walk(lca, second_path, lca_depth, second_depth, true, second, pinned,
+               pinned_count);
+
+    if (!err && *second && *second != *first)
+      err = writer_tryentry(&(*second)->mon);
+
+    if (!err && *second)
+      break;
+
+    writer_exit(&(*first)->mon);
+    *t1 = *t2 = NULL;
+
+    if (err != EBUSY)
+      break;
+
+    unpin_dirs(pinned, *pinned_count);
+    *pinned_count = 0;
+    sched_yield();
+  }
+
+  return err;
+}
+
+/* -------------------------------------------------------------------------- */
+
+Tree* tree_new()
+{
+  Tree* tree = malloc(sizeof(Tree));
+
+  if (!tree)
+    return NULL;
+
+  tree->arena = arena_new(sizeof(Dir), dir_ctor, dir_dtor);
+
+  if (!tree->arena) {
+    free(tree);
+    return NULL;
+  }
+
+  tree->root = new_dir(tree, ROOT_PATH, strlen(ROOT_PATH));
+  tree->cache = aligned_alloc(alignof(PathCache), sizeof(PathCache));
+
+  if (!tree->root || !tree->cache ||
+      pthread_mutex_init(&tree->snapshot_lock, NULL)) {
+    free(tree->cache);
+    arena_free(tree->arena);
+    free(tree);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < CACHE_STRIPES; ++i) {
+    atomic_init(&tree->cache->counters[i].hits, 0);
+    atomic_init(&tree->cache->counters[i].misses, 0);
+    atomic_init(&tree->cache->counters[i].invalidations, 0);
+  }
+
+  for (size_t i = 0; i < CACHE_SLOTS; ++i)
+    atomic_init(&tree->cache->slots[i], NULL);
+
+  tree->origin = NULL;
+  tree->snapshot_id = 0;
+  atomic_init(&tree->last_snapshot, 0);
+  atomic_init(&tree->oldest_snapshot, UINT64_MAX);
+  tree->snapshots = NULL;
+  tree->snapshot_count = 0;
+  tree->snapshot_size = 0;
+  tree->parked = NULL;
+  tree->wal = NULL;
+  return tree;
+}
+
+Tree* tree_snapshot(Tree* tree)
+{
+  Tree* origin = tree->origin ? tree->origin : tree;
+  Tree* snapshot = malloc(sizeof(Tree));
+  uint64_t* snapshots;
+  size_t size;
+  int err;
+
+  if (!snapshot)
+    return NULL;
+
+  err = pthread_mutex_lock(&origin->snapshot_lock);
+  syserr(err, "tree snapshot, mutex lock");
+
+  if (origin->snapshot_count == origin->snapshot_size) {
+    size = origin->snapshot_size ? 2 * origin->snapshot_size : 8;
+    snapshots = realloc(origin->snapshots, size * sizeof(uint64_t));
+
+    if (!snapshots) {
+      err = pthread_mutex_unlock(&origin->snapshot_lock);
+      syserr(err, "tree snapshot, mutex unlock");
+      free(snapshot);
+      return NULL;
+    }
+
+    origin->snapshots = snapshots;
+    origin->snapshot_size = size;
+  }
+
+  /* A snapshot of a snapshot is the same one again. A new one is the oldest
+   * before its id is given out, so that writers reading the id know it is
+   * there. */
+  if (tree->origin) {
+    snapshot->snapshot_id = tree->snapshot_id;
+  } else {
+    snapshot->snapshot_id = atomic_load(&origin->last_snapshot) + 1;
+
+    if (atomic_load(&origin->oldest_snapshot) > snapshot->snapshot_id)
+      atomic_store(&origin->oldest_snapshot, snapshot->snapshot_id);
+
+    atomic_store(&origin->last_snapshot, snapshot->snapshot_id);
+  }
+
+  origin->snapshots[origin->snapshot_count++] = snapshot->snapshot_id;
+  err = pthread_mutex_unlock(&origin->snapshot_lock);
+  syserr(err, "tree snapshot, mutex unlock");
+
+  snapshot->root = origin->root;
+  snapshot->arena = origin->arena;
+  snapshot->origin = origin;
+  snapshot->wal = NULL;
+  snapshot->cache = NULL;
+  return snapshot;
+}
+
+/** Forget a snapshot and free the subtrees only it still needed. */
+static void free_snapshot(Tree* snapshot)
+{
+  Tree* origin = snapshot->origin;
+  uint64_t oldest = UINT64_MAX;
+  Parked** link = &origin->parked;
+  Parked* released = NULL;
+  Parked* parked;
+  size_t i;
+  int err;
+
+  err = pthread_mutex_lock(&origin->snapshot_lock);
+  syserr(err, "free snapshot, mutex lock");
+
+  for (i = 0; origin->snapshots[i] != snapshot->snapshot_id; ++i)
+    ;
+
+  origin->snapshots[i] = origin->snapshots[--origin->snapshot_count];
+
+  for (i = 0; i < origin->snapshot_count; ++i)
+    if (origin->snapshots[i] < oldest)
+      oldest = origin->snapshots[i];
+
+  atomic_store(&origin->oldest_snapshot, oldest);
+
+  while ((parked = *link)) {
+    if (parked->id < oldest) {
+      *link = parked->next;
+      parked->next = released;
+      released = parked;
+    } else {
+      link = &parked->next;
+    }
+  }
+
+  err = pthread_mutex_unlock(&origin->snapshot_lock);
+  syserr(err, "free snapshot, mutex unlock");
+
+  for (; released; released = parked) {
+    parked = released->next;
+    epoch_retire(released->dir, release_subtree, origin->arena);
+    free(released);
+  }
+
+  free(snapshot);
+}
+
+/** What goes with a tree besides its arena. */
+static void free_tree(Tree* tree)
+{
+  Parked* next;
+
+  for (; tree->parked; tree->parked = next) {
+    next = tree->parked->next;
+    free(tree->parked);
+  }
+
+  if (tree->wal)
+    wal_close(tree->wal);
+
+  for (size_t i = 0; i < CACHE_SLOTS; ++i)
+    free(atomic_load(&tree->cache->slots[i]));
+
+  free(tree->cache);
+  free(tree->snapshots);
+  pthread_mutex_destroy(&tree->snapshot_lock);
+  free(tree);
+}
+
+void tree_free(Tree* tree)
+{
+  if (tree->origin) {
+    free_snapshot(tree);
+    return;
+  }
+
+  /* retired nodes go back to the arena first, then every node, name and map
+   * table goes away with it in one sweep */
+  epoch_barrier();
+  arena_free(tree->arena);
+  free_tree(tree);
+}
+
+void tree_free_parallel(Tree* tree, unsigned nthreads)
+{
+  if (tree->origin) {
+    free_snapshot(tree);
+    return;
+  }
+
+  epoch_barrier();
+  arena_free_parallel(tree->arena, nthreads);
+  free_tree(tree);
+}
+
+/** The directories a lockless walk went through and what their counters read. */
+typedef struct Snapshot {
+  Dir* dirs[MAX_PATH_LEN / 2 + 1];
+  uint32_t seqs[MAX_PATH_LEN / 2 + 1];
+  size_t depth;
+} Snapshot;
+
+/**
+ * Find the directory a `path` leads to without taking any locks, from within a
+ * read section. Every map on the path is read optimistically, it is up to the
+ * caller to check with `snapshot_valid` that none of them has changed after
+ * it is done with the directory. The directory is saved under `dest`, NULL if
+ * there is none. Returns false if it has to be tried again, also right away if
+ * a writer is in the middle of changing one of the maps.
+ */
+static bool snapshot_walk(Tree* tree, const PathView* path, Snapshot* snap,
+                          Dir** dest)
+{
+  const char* name;
+  size_t len;
+
+  snap->depth = 0;
+  snap->dirs[0] = *dest = tree->root;
+  if (!seq_read_try(&tree->root->seq, &snap->seqs[0]))
+    return false;
+
+  while (snap->depth < path->depth) {
+    name = path_component(path, snap->depth, &len);
+    *dest = hmap_getn(&snap->dirs[snap->depth]->subdirs, name, len);
+
+    if (!seq_read_valid(&snap->dirs[snap->depth]->seq,
+                        snap->seqs[snap->depth]))
+      return false;
+
+    if (!*dest)
+      break;
+
+    snap->dirs[++snap->depth] = *dest;
+
+    if (!seq_read_try(&(*dest)->seq, &snap->seqs[snap->depth]))
+      return false;
+  }
+
+  return true;
+}
+
+/** Whether the whole path of a `snapshot_walk` is still there as it was. */
+static bool snapshot_valid(const Snapshot* snap)
+{
+  for (size_t i = snap->depth + 1; i --> 0; )
+    if (!seq_read_valid(&snap->dirs[i]->seq, snap->seqs[i]))
+      return false;
+
+  return true;
+}
+
+/**
+ * Find the child of a directory called like the first `len` characters of
+ * `name` as the snapshot `id` sees it, from within a read section. Returns
+ * false if it has to be tried again.
+ */
+static bool child_as_of(Dir* dir, uint64_t id, const char* name, size_t len,
+                        Dir** child)
+{
+  uint32_t seq = seq_read_begin(&dir->seq);
+  Version* version = version_for(dir, id);
+
+  if (version) {
+    *child = version_child(version, name, len);
+    return true;
+  }
+
+  /* not changed since, unless a writer is saving a version right now */
+  *child = hmap_getn(&dir->subdirs, name, len);
+  return seq_read_valid(&dir->seq, seq);
+}
+
+/**
+ * `visit_listing` for a snapshot. Versions never change and the directories
+ * without one are read like by `snapshot_walk`, so no lock is ever taken and
+ * `fn` runs once.
+ */
+static bool visit_listing_as_of(Tree* snapshot, const PathView* path,
+                                void fn(const Listing*, void*), void* arg)
+{
+  uint64_t id = snapshot->snapshot_id;
+  unsigned token = epoch_enter();
+  Dir* dir = snapshot->root;
+  Dir* child;
+  Version* version;
+  Listing* listing;
+  const char* name;
+  size_t len;
+  size_t depth = 0;
+  uint32_t seq;
+  bool owned;
+
+  while (dir && depth < path->depth) {
+    name = path_component(path, depth, &len);
+
+    if (child_as_of(dir, id, name, len, &child)) {
+      dir = child;
+      ++depth;
+    }
+  }
+
+  while (dir) {
+    /* only a listing `get_listing` made may be ours, never a version's */
+    owned = false;
+    seq = seq_read_begin(&dir->seq);
+    version = version_for(dir, id);
+    listing = version ? version->listing : get_listing(dir, seq, &owned);
+
+    if (version || seq_read_valid(&dir->seq, seq)) {
+      fn(listing, arg);
+
+      if (owned)
+        free(listing);
+
+      break;
+    }
+
+    if (owned)
+      free(listing);
+  }
+
+  epoch_exit(token);
+  return dir != NULL;
+}
+
+/**
+ * Run `fn` with `arg` on the listing of the directory a `path` leads to.
+ * Returns false if there is no such directory.
+ *
+ * The listing is first looked at without taking any locks, in which case `fn`
+ * may be run a few times over listings that turn out to be out of date: only
+ * its last run counts. If the path keeps changing or writers are in the middle
+ * of changing it, the directory is read locked like by any other operation
+ * rather than waited for in a read section.
+ */
+static bool visit_listing(Tree* tree, const PathView* path,
+                          void fn(const Listing*, void*), void* arg)
+{
+  Snapshot snap;
+  CacheEntry* entry;
+  CacheEntry* evicted;
+  Listing* listing;
+  Dir* dir;
+  Dir* pinned[MAX_PATH_LEN / 2 + 1];
+  size_t pinned_count;
+  unsigned token;
+  uint32_t seq;
+  bool owned;
+  bool done;
+  int err;
+
+  if (tree->origin)
+    return visit_listing_as_of(tree, path, fn, arg);
+
+  for (int i = 0; i < LIST_ATTEMPTS; ++i) {
+    if (i)
+      sched_yield();
+
+    evicted = NULL;
+    token = epoch_enter();
+    entry = cache_find(tree, path, path->depth, &evicted);
+
+    /* a cached path only needs its directories not detached meanwhile, the
+     * maps above may change all they want */
+    if (entry) {
+      dir = entry->dirs[entry->depth];
+      done = seq_read_try(&dir->seq, &seq);
+
+      if (done) {
+        listing = get_listing(dir, seq, &owned);
+        fn(listing, arg);
+
+        if (owned)
+          free(listing);
+
+        done = seq_read_valid(&dir->seq, seq);
+      }
+
+      if (!cache_valid(entry)) {
+        done = false;
+        evicted = cache_evict(tree, entry);
+      }
+
+      epoch_exit(token);
+
+      if (evicted)
+        epoch_defer_free(evicted);
+
+      if (done) {
+        cache_count(&cache_counters(tree)->hits);
+        return true;
+      }
+
+      continue;
+    }
+
+    done = snapshot_walk(tree, path, &snap, &dir);
+
+    if (done && dir) {
+      entry = cache_new(path, snap.depth, snap.dirs);
+      listing = get_listing(dir, snap.seqs[snap.depth], &owned);
+      fn(listing, arg);
+
+      if (owned)
+        free(listing);
+
+      done = snapshot_valid(&snap);
+    }
+
+    epoch_exit(token);
+
+    if (evicted)
+      epoch_defer_free(evicted);
+
+    /* the walk was right at some point, the counters read before tell when */
+    if (entry && done)
+      cache_publish(tree, entry);
+    else
+      free(entry);
+
+    if (done)
+      return dir != NULL;
+  }
+
+  /* the path keeps changing, wait for the writers like they wait for us */
+  err = access_dir(tree, path, path->depth, &dir, reader_entry, pinned,
+                   &pinned_count);
+
+  if (err || !dir) {
+    unpin_dirs(pinned, pinned_count);
+    return false;
+  }
+
+  /* the kept listing may be replaced by another reader meanwhile */
+  token = epoch_enter();
+  listing = get_listing(dir, seq_read_begin(&dir->seq), &owned);
+  fn(listing, arg);
+
+  if (owned)
+    free(listing);
+
+  epoch_exit(token);
+
+  reader_exit(&dir->mon);
+  unpin_dirs(pinned, pinned_count);
+
+  return true;
+}
+
+/**
+ * `visit_listing` callback of `tree_list`, `arg` is where to put the copy. It
+ * is left NULL if out of memory.
+ */
+static void copy_listing(const Listing* listing, void* arg)
+{
+  char** contents = arg;
+  size_t len = listing_len(listing);
+
+  free(*contents);
+  *contents = malloc(len + 1);
+
+  if (*contents)
+    memcpy(*contents, listing->contents, len + 1);
+}
+
+char* tree_list(Tree* tree, const char* path)
+{
+  PathView view;
+  char* contents = NULL;
+
+  if (!path_parse(path, &view))
+    return NULL;
+
+  if (!visit_listing(tree, &view, copy_listing, &contents)) {
+    free(contents);
+    return NULL;
+  }
+
+  return contents;
+}
+
+/** What `tree_list_range` asks for and gets from its `visit_listing`. */
+typedef struct Range {
+  const char* after;
+  size_t limit;
+  char* buf;
+  size_t buflen;
+  int result;
+} Range;
+
+/** `visit_listing` callback of `tree_list_range`. */
+static void copy_range(const Listing* listing, void* arg)
+{
+  Range* range = arg;
+  size_t lo = 0;
+  size_t hi = listing->count;
+  size_t mid;
+  size_t len;
+  size_t used = 0;
+  int copied = 0;
+
+  /* the first name after the cursor */
+  while (range->after && lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    len = listing->start[mid + 1] - listing->start[mid] - 1;
+
+    if (strncmp(listing->contents + listing->start[mid], range->after,
+                len) > 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  for (size_t i = lo; i < listing->count && copied < range->limit; ++i) {
+    len = listing->start[i + 1] - listing->start[i] - 1;
+
+    /* the separator or the terminating null */
+    if (used + len + 1 > range->buflen)
+      break;
+
+    if (copied)
+      range->buf[used - 1] = ',';
+
+    memcpy(range->buf + used, listing->contents + listing->start[i], len);
+    used += len + 1;
+    range->buf[used - 1] = '\0';
+    ++copied;
+  }
+
+  if (!copied && range->buflen)
+    range->buf[0] = '\0';
+
+  range->result = !copied && lo < listing->count && range->limit ? -ERANGE
+                                                                 : copied;
+}
+
+int tree_list_range(Tree* tree, const char* path, const char* after_name,
+                    size_t limit, char* buf, size_t buflen)
+{
+  PathView view;
+  Range range = { after_name, limit > INT_MAX ? INT_MAX : limit, buf, buflen,
+                  0 };
+
+  if (!path_parse(path, &view))
+    return -EINVAL;
+
+  if (!visit_listing(tree, &view, copy_range, &range))
+    return -ENOENT;
+
+  return range.result;
+}
+
+/** A growing string. */
+typedef struct Buffer {
+  char* data;
+  size_t len;
+  size_t size;
+} Buffer;
+
+/**
+ * Make room in a buffer for `len` more characters and the terminator. Returns
+ * false if out of memory, the buffer stays as it was then.
+ */
+static bool buffer_reserve(Buffer* buf, size_t len)
+{
+  size_t size = buf->size;
+  char* data;
+
+  if (buf->len + len + 1 <= size)
+    return true;
+
+  while (buf->len + len + 1 > size)
+    size = size ? 2 * size : 256;
+
+  data = realloc(buf->data, size);
+
+  if (!data)
+    return false;
+
+  buf->data = data;
+  buf->size = size;
+  return true;
+}
+
+/** Append `len` characters of `str` to a buffer. */
+static void buffer_append(Buffer* buf, const char* str, size_t len)
+{
+  if (!buffer_reserve(buf, len))
+    exit(1);
+
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
+
+/** A directory `tree_list_recursive` is in the middle of. */
+typedef struct Frame {
+  Dir* dir;
+  Listing* listing;
+  bool owned;
+  /* the next name of the listing to descend into */
+  size_t next;
+  /* length of the directory's path below the listed one */
+  size_t prefix;
+} Frame;
+
+/**
+ * Start a frame of a read locked directory for `tree_list_recursive`. The
+ * listing stays as long as the lock: only writers drop kept listings and
+ * readers only replace those out of date.
+ */
+static void enter_frame(Frame* frame, Dir* dir, size_t prefix)
+{
+  unsigned token = epoch_enter();
+
+  frame->listing = get_listing(dir, seq_read_begin(&dir->seq), &frame->owned);
+  epoch_exit(token);
+
+  frame->dir = dir;
+  frame->next = 0;
+  frame->prefix = prefix;
+}
+
+/** Let go of everything `tree_list_recursive` holds. */
+static void leave_frames(Frame* stack, size_t depth, Dir* locked[],
+                         size_t locked_count)
+{
+  for (size_t i = 0; i < depth; ++i)
+    if (stack[i].owned)
+      free(stack[i].listing);
+
+  for (size_t i = 0; i < locked_count; ++i)
+    reader_exit(&locked[i]->mon);
+}
+
+char* tree_list_recursive(Tree* tree, const char* path)
+{
+  PathView view;
+  Dir* dir;
+  Dir* pinned[MAX_PATH_LEN / 2 + 1];
+  size_t pinned_count;
+  /* everything read locked, released together at the end */
+  Dir** locked = NULL;
+  size_t locked_count;
+  size_t locked_size = 0;
+  /* moves can make the subtree deeper than any path */
+  Frame* stack = NULL;
+  size_t depth;
+  size_t stack_size = 0;
+  Frame* top;
+  Buffer out = { NULL, 0, 0 };
+  Buffer name = { NULL, 0, 0 };
+  const char* child_name;
+  size_t len;
+  Dir* busy = NULL;
+  bool found = false;
+  int err;
+
+  if (!path_parse(path, &view) || tree->origin)
+    return NULL;
+
+  /* Holding every lock until the end keeps the whole subtree still, so the
+   * result is a snapshot of it. No pins are needed below the listed directory
+   * as nothing can be detached from a read locked parent.
+   *
+   * Only the listed directory is waited for. Waiting for any other while
+   * holding locks could close a cycle with writers draining pins, so like in
+   * `double_access` we let everything go if one is busy. The busy one stays
+   * pinned and we sleep on its lock with nothing else held, so we start over
+   * once its writer is done instead of spinning until it is. */
+  for (;;) {
+    err = access_dir(tree, &view, view.depth, &dir, reader_entry, pinned,
+                     &pinned_count);
+
+    if (err || !dir) {
+      unpin_dirs(pinned, pinned_count);
+      break;
+    }
+
+    found = true;
+    locked_count = 0;
+    depth = 0;
+    name.len = 0;
+    out.len = 0;
+    buffer_append(&out, "", 0);
+
+    while (dir) {
+      if (locked_count == locked_size) {
+        locked_size = locked_size ? 2 * locked_size : 64;
+        locked = realloc(locked, locked_size * sizeof(Dir*));
+
+        if (!locked)
+          exit(1);
+      }
+
+      if (depth == stack_size) {
+        stack_size = stack_size ? 2 * stack_size : 16;
+        stack = realloc(stack, stack_size * sizeof(Frame));
+
+        if (!stack)
+          exit(1);
+      }
+
+      locked[locked_count++] = dir;
+      enter_frame(&stack[depth++], dir, name.len);
+      dir = NULL;
+
+      while (depth && !dir) {
+        top = &stack[depth - 1];
+
+        if (top->next == top->listing->count) {
+          if (top->owned)
+            free(top->listing);
+
+          --depth;
+          continue;
+        }
+
+        child_name = top->listing->contents + top->listing->start[top->next];
+        len = top->listing->start[top->next + 1] -
+              top->listing->start[top->next] - 1;
+        ++top->next;
+
+        /* the child's path below the listed directory */
+        name.len = top->prefix;
+
+        if (name.len)
+          buffer_append(&name, "/", 1);
+
+        buffer_append(&name, child_name, len);
+
+        if (out.len)
+          buffer_append(&out, ",", 1);
+
+        buffer_append(&out, name.data, name.len);
+
+        dir = hmap_getn(&top->dir->subdirs, child_name, len);
+        err = reader_tryentry(&dir->mon);
+
+        if (err) {
+          /* cannot be detached before we unlock its parent */
+          busy = dir;
+          pin(&busy->pins);
+          break;
+        }
+      }
+
+      if (err)
+        break;
+    }
+
+    leave_frames(stack, depth, locked, locked_count);
+    unpin_dirs(pinned, pinned_count);
+
+    if (err && err != EBUSY)
+      unpin(&busy->pins);
+
+    if (err != EBUSY)
+      break;
+
+    err = reader_entry(&busy->mon);
+    syserr(err, "tree_list_recursive: Failed to enter a monitor");
+    err = reader_exit(&busy->mon);
+    syserr(err, "tree_list_recursive: Failed to exit a monitor");
+    unpin(&busy->pins);
+  }
+
+  if (err || !found) {
+    free(out.data);
+    out.data = NULL;
+  }
+
+  free(locked);
+  free(stack);
+  free(name.data);
+  return out.data;
+}
+
+/**
+ * A directory `tree_walk` has to visit. It keeps its directory pinned until it
+ * and all of its descendants have been visited, so that whatever is queued
+ * below stays in the tree like under any other operation.
+ */
+typedef struct Task {
+  Dir* dir;
+  struct Task* parent;
+  /* one for the visit of `dir` and one for each child task not done yet */
+  atomic_size_t pending;
+  /* the visitor has been called already, the children are yet to be taken */
+  bool visited;
+  size_t depth;
+  char* path;
+} Task;
+
+/** A double-ended queue of tasks, a ring buffer of a power of two size. */
+typedef struct Deque {
+  pthread_mutex_t lock;
+  Task** tasks;
+  size_t size;
+  /* free running, `tail - head` tasks are queued */
+  size_t head;
+  size_t tail;
+} Deque;
+
+/** What the workers of a `tree_walk` share. */
+typedef struct Walk {
+  Tree* tree;
+  TreeVisitor* visitor;
+  void* ctx;
+  Deque* deques;
+  unsigned nthreads;
+  /* tasks queued or being visited, the walk ends at zero */
+  atomic_size_t remaining;
+  atomic_bool failed;
+} Walk;
+
+/**
+ * The tree a `tree_walk` this thread is calling the visitor of walks, NULL
+ * outside of visitors. Detaching a directory from it would wait for the pins
+ * of the walk, which cannot go before the visitor returns.
+ */
+static _Thread_local Tree* visiting;
+
+/** A worker of a `tree_walk` and the deque it owns. */
+typedef struct Worker {
+  Walk* walk;
+  unsigned id;
+} Worker;
+
+/** Make room for one more task, the deque must be locked. */
+static bool deque_grow(Deque* deque)
+{
+  size_t size = deque->size ? 2 * deque->size : 64;
+  Task** tasks;
+
+  if (deque->tail - deque->head < deque->size)
+    return true;
+
+  tasks = malloc(size * sizeof(Task*));
+
+  if (!tasks)
+    return false;
+
+  for (size_t i = deque->head; i != deque->tail; ++i)
+    tasks[i - deque->head] = deque->tasks[i & (deque->size - 1)];
+
+  free(deque->tasks);
+  deque->tasks = tasks;
+  deque->tail -= deque->head;
+  deque->head = 0;
+  deque->size = size;
+  return true;
+}
+
+/**
+ * Queue a task at the back, where its owner takes the next one from, or at the
+ * front, where thieves steal from.
+ */
+static bool deque_push(Deque* deque, Task* task, bool front)
+{
+  bool ok;
+  int err;
+
+  err = pthread_mutex_lock(&deque->lock);
+  syserr(err, "tree_walk: Failed to lock a deque");
+  ok = deque_grow(deque);
+
+  if (ok && front)
+    deque->tasks[--deque->head & (deque->size - 1)] = task;
+  else if (ok)
+    deque->tasks[deque->tail++ & (deque->size - 1)] = task;
+
+  err = pthread_mutex_unlock(&deque->lock);
+  syserr(err, "tree_walk: Failed to unlock a deque");
+  return ok;
+}
+
+/** Take a task from the back or the front, NULL if there is none. */
+static Task* deque_pop(Deque* deque, bool front)
+{
+  Task* task = NULL;
+  int err;
+
+  err = pthread_mutex_lock(&deque->lock);
+  syserr(err, "tree_walk: Failed to lock a deque");
+
+  if (deque->head != deque->tail && front)
+    task = deque->tasks[deque->head++ & (deque->size - 1)];
+  else if (deque->head != deque->tail)
+    task = deque->tasks[--deque->tail & (deque->size - 1)];
+
+  err = pthread_mutex_unlock(&deque->lock);
+  syserr(err, "tree_walk: Failed to unlock a deque");
+  return task;
+}
+
+/** A new task for a pinned directory, NULL if out of memory. */
+static Task* new_task(Dir* dir, Task* parent, const char* path, size_t len,
+                      const char* name, size_t name_len, size_t depth)
+{
+  Task* task = malloc(sizeof(Task));
+
+  if (!task)
+    return NULL;
+
+  /* the name and a '/' after it */
+  task->path = malloc(len + name_len + 2);
+
+  if (!task->path) {
+    free(task);
+    return NULL;
+  }
+
+  memcpy(task->path, path, len);
+  memcpy(task->path + len, name, name_len);
+
+  if (name_len)
+    task->path[len + name_len++] = '/';
+
+  task->path[len + name_len] = '\0';
+  task->dir = dir;
+  task->parent = parent;
+  atomic_init(&task->pending, 1);
+  task->visited = false;
+  task->depth = depth;
+  return task;
+}
+
+/** One of a task's pending counts is done, unpin what is finished for good. */
+static void finish_task(Task* task)
+{
+  Task* parent;
+
+  while (task && atomic_fetch_sub(&task->pending, 1) == 1) {
+    parent = task->parent;
+    unpin(&task->dir->pins);
+    free(task->path);
+    free(task);
+    task = parent;
+  }
+}
+
+/**
+ * Visit a task's directory and queue its children. Returns false if the
+ * directory is locked by a writer and its children have to be taken later:
+ * waiting for it while holding the pins of the queued tasks could close a
+ * cycle with writers draining them, see `tree_list_recursive`.
+ */
+static bool visit_task(Worker* self, Task* task)
+{
+  Walk* walk = self->walk;
+  HashMapIterator it;
+  const char* name;
+  void* child;
+  Task* sub;
+  Tree* outer;
+  size_t len = strlen(task->path);
+
+  /* before any child can be visited by somebody else; the visitor may walk
+   * another tree itself */
+  if (!task->visited) {
+    outer = visiting;
+    visiting = walk->tree;
+    walk->visitor(task->path, task->depth, walk->ctx);
+    visiting = outer;
+    task->visited = true;
+  }
+
+  if (reader_tryentry(&task->dir->mon))
+    return false;
+
+  it = hmap_iterator(&task->dir->subdirs);
+
+  while (hmap_next(&task->dir->subdirs, &it, &name, &child)) {
+    sub = new_task(child, task, task->path, len, name, strlen(name),
+                   task->depth + 1);
+
+    if (!sub) {
+      atomic_store(&walk->failed, true);
+      break;
+    }
+
+    /* cannot be detached before we unlock, then the pin holds it; all of it
+     * has to be set up before a thief can finish the task */
+    pin(&((Dir*)child)->pins);
+    atomic_fetch_add(&task->pending, 1);
+    atomic_fetch_add(&walk->remaining, 1);
+
+    if (!deque_push(&walk->deques[self->id], sub, false)) {
+      atomic_fetch_sub(&walk->remaining, 1);
+      finish_task(sub);
+      atomic_store(&walk->failed, true);
+      break;
+    }
+  }
+
+  reader_exit(&task->dir->mon);
+  return true;
+}
+
+/**
+ * A worker of `tree_walk`. It goes depth first through its own deque and when
+ * that runs dry steals the shallowest task of another worker, so big subtrees
+ * get shared out.
+ */
+static void* walk_worker(void* arg)
+{
+  Worker* self = arg;
+  Walk* walk = self->walk;
+  Task* task;
+
+  while (atomic_load(&walk->remaining) > 0) {
+    task = deque_pop(&walk->deques[self->id], false);
+
+    for (unsigned i = 1; !task && i < walk->nthreads; ++i)
+      task = deque_pop(&walk->deques[(self->id + i) % walk->nthreads], true);
+
+    if (!task) {
+      sched_yield();
+      continue;
+    }
+
+    if (!visit_task(self, task)) {
+      /* the rest of ours goes first, a writer there may be waiting for it */
+      if (!deque_push(&walk->deques[self->id], task, true)) {
+        atomic_store(&walk->failed, true);
+        atomic_fetch_sub(&walk->remaining, 1);
+        finish_task(task);
+      }
+
+      sched_yield();
+      continue;
+    }
+
+    atomic_fetch_sub(&walk->remaining, 1);
+    finish_task(task);
+  }
+
+  return NULL;
+}
+
+int tree_walk(Tree* tree, const char* path, TreeVisitor* visitor, void* ctx,
+              unsigned nthreads)
+{
+  PathView view;
+  Dir* dir;
+  Dir* pinned[MAX_PATH_LEN / 2 + 1];
+  size_t pinned_count;
+  pthread_t* threads = NULL;
+  Worker* workers = NULL;
+  unsigned started = 0;
+  Walk walk;
+  Task* root;
+  int err = 0;
+
+  if (!path_parse(path, &view))
+    return EINVAL;
+
+  if (tree->origin)
+    return ENOTSUP;
+
+  if (nthreads < 1)
+    nthreads = 1;
+
+  walk.tree = tree;
+  walk.visitor = visitor;
+  walk.ctx = ctx;
+  walk.nthreads = nthreads;
+  atomic_init(&walk.remaining, 1);
+  atomic_init(&walk.failed, false);
+  walk.deques = calloc(nthreads, sizeof(Deque));
+  workers = malloc(nthreads * sizeof(Worker));
+  threads = malloc(nthreads * sizeof(pthread_t));
+
+  if (!walk.deques || !workers || !threads) {
+    free(walk.deques);
+    free(workers);
+    free(threads);
+    return ENOMEM;
+  }
+
+  for (unsigned i = 0; i < nthreads; ++i) {
+    err = pthread_mutex_init(&walk.deques[i].lock, NULL);
+    syserr(err, "tree_walk: Failed to initialise a deque");
+    workers[i].walk = &walk;
+    workers[i].id = i;
+  }
+
+  /* the walk starts like any other operation, the root task takes over the
+   * pin of its directory */
+  err = access_dir(tree, &view, view.depth, &dir, reader_entry, pinned,
+                   &pinned_count);
+
+  if (err || !dir)
+    ERROR(err ? err : ENOENT);
+
+  reader_exit(&dir->mon);
+  pin(&dir->pins);
+  root = new_task(dir, NULL, path, strlen(path), "", 0, view.depth);
+
+  if (!root) {
+    unpin(&dir->pins);
+    ERROR(ENOMEM);
+  }
+
+  if (!deque_push(&walk.deques[0], root, false)) {
+    finish_task(root);
+    ERROR(ENOMEM);
+  }
+
+  /* the caller is one of the workers, fewer threads just mean less help */
+  while (started < nthreads - 1 &&
+         !pthread_create(&threads[started], NULL, walk_worker,
+                         &workers[started + 1]))
+    ++started;
+
+  walk_worker(&workers[0]);
+
+  for (unsigned i = 0; i < started; ++i) {
+    err = pthread_join(threads[i], NULL);
+    syserr(err, "tree_walk: Failed to join a worker");
+  }
+
+  err = atomic_load(&walk.failed) ? ENOMEM : 0;
+
+exiting:
+  unpin_dirs(pinned, pinned_count);
+
+  for (unsigned i = 0; i < nthreads; ++i) {
+    pthread_mutex_destroy(&walk.deques[i].lock);
+    free(walk.deques[i].tasks);
+  }
+
+  free(walk.deques);
+  free(workers);
+  free(threads);
+  return err;
+}
+
+/** First bytes of a file written by `tree_save`. */
+#define FILE_MAGIC "DIRTREE"
+#define FILE_VERSION 1
+
+/**
+ * A saved tree is this header, a table of `node_count` nodes and a heap of
+ * `names_len` bytes with their names, in native byte order. Nodes come in
+ * breadth first order with the root first, so the children of each node are
+ * one range of the table, which starts right after the children of the nodes
+ * before it.
+ */
+typedef struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;
+  uint64_t node_count;
+  uint64_t names_len;
+} FileHeader;
+
+typedef struct FileNode {
+  /* where the name starts in the heap, it is not null terminated */
+  uint64_t name;
+  uint64_t first_child;
+  uint32_t name_len;
+  uint32_t child_count;
+} FileNode;
+
+/** A saved tree being made in memory by `tree_save`. */
+typedef struct Image {
+  FileNode* nodes;
+  /* the directory of each node */
+  Dir** dirs;
+  size_t count;
+  size_t size;
+  Buffer names;
+} Image;
+
+/** Add a node for a directory called like the first `len` characters of
+ * `name` to an image. Returns false if out of memory. */
+static bool image_add(Image* image, Dir* dir, const char* name, size_t len)
+{
+  FileNode* nodes;
+  Dir** dirs;
+  size_t size;
+
+  if (image->count == image->size) {
+    size = image->size ? 2 * image->size : 1024;
+    nodes = realloc(image->nodes, size * sizeof(FileNode));
+
+    if (!nodes)
+      return false;
+
+    image->nodes = nodes;
+    dirs = realloc(image->dirs, size * sizeof(Dir*));
+
+    if (!dirs)
+      return false;
+
+    image->dirs = dirs;
+    image->size = size;
+  }
+
+  if (!buffer_reserve(&image->names, len))
+    return false;
+
+  image->nodes[image->count] = (FileNode){ image->names.len, 0, len, 0 };
+  image->dirs[image->count++] = dir;
+  buffer_append(&image->names, name, len);
+  return true;
+}
+
+/**
+ * Add the children of a directory as the snapshot `id` sees them to an image,
+ * from within a read section. The live map is read without making a listing,
+ * which would stay behind in every directory of the tree. Returns false if out
+ * of memory.
+ */
+static bool image_add_children(Image* image, Dir* dir, uint64_t id)
+{
+  size_t count = image->count;
+  size_t names_len = image->names.len;
+  HashMapIterator it;
+  const Listing* listing;
+  Version* version;
+  const char* name;
+  void* child;
+  uint32_t seq;
+
+  for (;;) {
+    seq = seq_read_begin(&dir->seq);
+    version = version_for(dir, id);
+
+    if (version) {
+      listing = version->listing;
+
+      for (size_t i = 0; i < listing->count; ++i)
+        if (!image_add(image, version->dirs[i],
+                       listing->contents + listing->start[i],
+                       listing->start[i + 1] - listing->start[i] - 1))
+          return false;
+
+      return true;
+    }
+
+    it = hmap_iterator(&dir->subdirs);
+
+    while (hmap_next(&dir->subdirs, &it, &name, &child))
+      if (!image_add(image, child, name, strlen(name)))
+        return false;
+
+    if (seq_read_valid(&dir->seq, seq))
+      return true;
+
+    image->count = count;
+    image->names.len = names_len;
+  }
+}
+
+int tree_save(Tree* tree, int fd)
+{
+  FileHeader header = { FILE_MAGIC, FILE_VERSION, sizeof(FileNode), 0, 0 };
+  Tree* snapshot = tree->origin ? tree : tree_snapshot(tree);
+  Image image = { NULL, NULL, 0, 0, { NULL, 0, 0 } };
+  unsigned token;
+  size_t first;
+  int err = 0;
+
+  if (!snapshot)
+    return ENOMEM;
+
+  /* The whole image is made in memory first, only then the node count is
+   * known. The nodes queued breadth first are the table. */
+  if (!image_add(&image, snapshot->root, "", 0))
+    err = ENOMEM;
+
+  for (size_t i = 0; !err && i < image.count; ++i) {
+    first = image.count;
+    token = epoch_enter();
+
+    if (!image_add_children(&image, image.dirs[i], snapshot->snapshot_id))
+      err = ENOMEM;
+
+    epoch_exit(token);
+    image.nodes[i].first_child = first;
+    image.nodes[i].child_count = image.count - first;
+  }
+
+  if (snapshot != tree)
+    tree_free(snapshot);
+
+  header.node_count = image.count;
+  header.names_len = image.names.len;
+
+  if (!err)
+    err = write_all(fd, &header, sizeof(header));
 
-/**
- * A helper function for creating a heap allocated new empty directory with
- * a given name. Copies the dname string.
- */
-static Tree* new_dir(const char* dname)
+  if (!err)
+    err = write_all(fd, image.nodes, image.count * sizeof(FileNode));
+
+  if (!err)
+    err = write_all(fd, image.names.data, image.names.len);
+
+  free(image.nodes);
+  free(image.dirs);
+  free(image.names.data);
+  return err;
+}
+
+/** Whether a node of a saved tree has a name a directory can have. */
+static bool file_name_valid(const FileNode* node, const char* names,
+                            uint64_t names_len)
 {
-  Tree* tree = malloc(sizeof(Tree));
+  if (node->name_len == 0 || node->name_len > MAX_DIR_NAME_LEN ||
+      node->name > names_len || node->name_len > names_len - node->name)
+    return false;
 
-  if (!tree)
-    return NULL;
+  for (size_t i = 0; i < node->name_len; ++i)
+    if (names[node->name + i] < 'a' || names[node->name + i] > 'z')
+      return false;
 
-  tree->dir_name = strdup(dname);
+  return true;
+}
 
-  if (!tree->dir_name) {
-    free(tree);
-    return NULL;
-  }
+Tree* tree_load(int fd)
+{
+  struct stat st;
+  const FileHeader* header;
+  const FileNode* nodes;
+  const char* names;
+  void* map;
+  Tree* tree = NULL;
+  Dir** dirs = NULL;
+  Dir* child;
+  uint64_t next = 1;
+  int err = 0;
 
-  tree->subdirs = hmap_new();
+  if (fstat(fd, &st))
+    return NULL;
 
-  if (!tree->subdirs) {
-    free(tree->dir_name);
-    free(tree);
+  if ((size_t)st.st_size < sizeof(FileHeader)) {
+    errno = EINVAL;
     return NULL;
   }
 
-  if (monit_init(&tree->mon)) {
-    free(tree->dir_name);
-    hmap_free(tree->subdirs);
-    free(tree);
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (map == MAP_FAILED)
     return NULL;
-  }
 
-  return tree;
-}
+  /* read once front to back */
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  header = map;
+  nodes = (const FileNode*)(header + 1);
+
+  if (memcmp(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC)) ||
+      header->version != FILE_VERSION ||
+      header->node_size != sizeof(FileNode) || header->node_count == 0 ||
+      header->node_count > (st.st_size - sizeof(FileHeader)) /
+                           sizeof(FileNode) ||
+      header->names_len != st.st_size - sizeof(FileHeader) -
+                           header->node_count * sizeof(FileNode))
+    ERROR(EINVAL);
+
+  names = (const char*)(nodes + header->node_count);
+  tree = tree_new();
+  dirs = malloc(header->node_count * sizeof(Dir*));
+
+  if (!tree || !dirs)
+    ERROR(ENOMEM);
 
-/**
- * Find a directory under a `path` and lock it and the path leading to it.
- * Saves the result under `dest`, returns some errno.
- *
- * If an error occured or the directory under `path` does not exist then `*dest`
- * will be set to `NULL`.
- *
- * The `entry_fn` function will be used to access each of the passed by dirs'
- * monitors. It returns an error code and its parameters are the monitor in
- * question and a boolean flag telling it whether it is visiting the target
- * monitor or one on the way.
- *
- * The `passedby` array will be filled with all monitors that were entered in
- * the process (apart from the destination one! It will be in the returned
- * tree).  Its size will be stored under `passed_count`. Exiting them should be
- * done by the caller accordingly with how they've chosen to enter them.
- */
-static int access_dir(Tree* root, const char* target, Tree** dest,
-                      int entry_fn(Monitor*, bool), Monitor* passedby[],
-                      size_t* passed_count)
-{
-  char component[MAX_DIR_NAME_LEN + 1];
-  Tree* next;
-  int err = 0;
+  dirs[0] = tree->root;
 
-  *passed_count = 0;
-  *dest = root;
+  /* Nobody else can see the tree yet, so the maps are filled directly. Each
+   * is sized for all of its children up front and never grows. */
+  for (uint64_t i = 0; i < header->node_count; ++i) {
+    if (nodes[i].first_child != next ||
+        nodes[i].child_count > header->node_count - next)
+      ERROR(EINVAL);
 
-  while ((target = split_path(target, component))) {
-    if (!*dest)
-      break;
+    if (!hmap_reserve(&dirs[i]->subdirs, nodes[i].child_count))
+      ERROR(ENOMEM);
 
-    err = entry_fn(&(*dest)->mon, false);
+    for (; next < nodes[i].first_child + nodes[i].child_count; ++next) {
+      if (!file_name_valid(&nodes[next], names, header->names_len))
+        ERROR(EINVAL);
 
-    if (err) {
-      *dest = NULL;
-      return err;
-    }
+      child = new_dir(tree, names + nodes[next].name, nodes[next].name_len);
 
-    passedby[(*passed_count)++] = &(*dest)->mon;
-    next = hmap_get((*dest)->subdirs, component);
-    *dest = next;
+      if (!child)
+        ERROR(ENOMEM);
+
+      /* the space is there, so it is a duplicate */
+      if (!hmap_insert(&dirs[i]->subdirs, child->dir_name, child)) {
+        free_dir(tree, child);
+        ERROR(EINVAL);
+      }
+
+      dirs[next] = child;
+    }
   }
 
-  if (*dest)
-    err = entry_fn(&(*dest)->mon, true);
+  if (next != header->node_count)
+    ERROR(EINVAL);
+
+exiting:
+  munmap(map, st.st_size);
+  free(dirs);
 
   if (err) {
-    *dest = NULL;
-    return err;
+    if (tree)
+      tree_free(tree);
+
+    errno = err;
+    return NULL;
   }
 
-  return 0;
+  return tree;
 }
 
-/** Exit monitors according to a given policy. */
-static void exit_monitors(Monitor* mons[], size_t count, int exit_fn(Monitor*))
-{
+/** The share of `tree_bulk_load`'s paths one of its workers builds. */
+typedef struct Loader {
+  Tree* tree;
+  const char** paths;
+  size_t count;
+  /* stands in for the root: the worker's top level directories go here */
+  Dir* top;
   int err;
+} Loader;
 
-  for (; count --> 0; ) {
-    err = exit_fn(mons[count]);
-    /* failure to unlock some parts of the tree breaks it beyond repair */
-    syserr(err, "exit_monitors: Failed to exit %lu'th  monitor", count);
-  }
-}
-
-/**
- * This is how the editing operations will enter directories. Depending on
- * whether this is their destination dir (`islast`) they will either lock it as
- * a writer or as a reader. Meaning that we treat an editing operation on an
- * ancestoral directory as a reader and it's a writer only on the last one.
- *
- * This function has a signature appropriate for the `entry_fn` argument in
- * `access_dir`.
- */
-static int edit_entry(Monitor* mon, bool islast)
+/** Which of `nthreads` loaders gets a path, by its first component. */
+static unsigned loader_of(const char* path, unsigned nthreads)
 {
-  if (islast)
-    return writer_entry(mon);
-  else
-    return reader_entry(mon);
+  uint64_t hash = 14695981039346656037ULL;
+
+  /* an invalid path goes anywhere, it is rejected there */
+  if (path[0] == '/')
+    for (const char* p = path + 1; *p && *p != '/'; ++p)
+      hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+
+  return hash % nthreads;
 }
 
-/**
- * For `tree_list` accessing of directories. A wrapper for reader's dir access.
- * Matches `entry_fn` in `access_dir`.
- */
-static int list_entry(Monitor* mon, bool islast)
+/** The number of leading components two paths have in common. */
+static size_t shared_depth(const PathView* a, const PathView* b)
 {
-  (void)islast;
-  return reader_entry(mon);
+  const char* name_a;
+  const char* name_b;
+  size_t len_a;
+  size_t len_b;
+  size_t depth = 0;
+
+  for (; depth < a->depth && depth < b->depth; ++depth) {
+    name_a = path_component(a, depth, &len_a);
+    name_b = path_component(b, depth, &len_b);
+
+    if (len_a != len_b || memcmp(name_a, name_b, len_a))
+      break;
+  }
+
+  return depth;
 }
 
 /**
- * For using the `access_dir` without any protection. This function is a mere
- * no-op satisfying the `entry_fn` signature.
+ * Build the subtrees of a loader's paths under its `top`. Nobody else can see
+ * them, so nothing is locked. Each path goes down from where it parts from the
+ * previous one, which for a listing in tree order is right at its parent.
  */
-static int chill_entry(Monitor* mon, bool islast)
+static void* bulk_worker(void* arg)
 {
-  (void)mon;
-  (void)islast;
-  return 0;
+  Loader* loader = arg;
+  PathView views[2];
+  PathView* view;
+  PathView* prev = NULL;
+  Dir* stack[MAX_PATH_LEN / 2 + 1];
+  Dir* child;
+  const char* name;
+  size_t len;
+
+  stack[0] = loader->top;
+
+  for (size_t i = 0; i < loader->count; ++i) {
+    view = &views[i & 1];
+
+    if (!path_parse(loader->paths[i], view)) {
+      loader->err = EINVAL;
+      return NULL;
+    }
+
+    for (size_t depth = prev ? shared_depth(prev, view) : 0;
+         depth < view->depth; ++depth) {
+      name = path_component(view, depth, &len);
+      child = hmap_getn(&stack[depth]->subdirs, name, len);
+
+      if (!child) {
+        child = new_dir(loader->tree, name, len);
+
+        if (!child) {
+          loader->err = ENOMEM;
+          return NULL;
+        }
+
+        if (!hmap_insert(&stack[depth]->subdirs, child->dir_name, child)) {
+          free_dir(loader->tree, child);
+          loader->err = ENOMEM;
+          return NULL;
+        }
+      }
+
+      stack[depth + 1] = child;
+    }
+
+    prev = view;
+  }
+
+  return NULL;
 }
 
-/**
- * Take hold of two directories simultaneously. This bears some resemblance to
- * the classic hungry philosophers problem where philosophers require posessing
- * two forks. In this analogy those are two directories (eg. in `tree_move`).
- * Naïve sequential taking of the two forks one by one won't work as we may
- * starve ourselves with a fellow philosopher. Breaking the symetry is not
- * really possible neither.
- *
- * Solution: join the forks with a string and take the string.
- * Translated to the actual dir tree: lock the LCA of the directories first.
- *
- * This function accesses both the contents under `p1` and `p2` and locks
- * writerly the `lca` dir and readlocks its ancestors (`edit_entry`). It does not
- * however lock `t1` and `t2` (`chill_entry`).
- */
-static int double_access(const char* p1, const char* p2, Tree* tree,
-                         Tree** lca, Tree** t1, Tree** t2,
-                         Monitor* passedby[], size_t* passed_count)
-{
-  const char* p1lca;
-  const char* p2lca;
-  Monitor* ignorepassed[MAX_PATH_LEN / 2];
-  size_t ignored;
-  char* lca_path = path_lca(p1, p2, &p1lca, &p2lca);
+Tree* tree_bulk_load(const char* const* paths, size_t n, unsigned nthreads)
+{
+  Tree* tree = tree_new();
+  Loader* loaders = NULL;
+  Loader* loader;
+  pthread_t* threads = NULL;
+  const char** order = NULL;
+  unsigned started = 0;
+  size_t total = 0;
+  HashMapIterator it;
+  const char* name;
+  void* child;
   int err = 0;
 
-  if (!lca_path) {
-    *passed_count = 0;
-    *lca = NULL;
-    return ENOMEM;
+  if (!tree)
+    return NULL;
+
+  if (nthreads > n)
+    nthreads = n;
+
+  if (nthreads < 1)
+    nthreads = 1;
+
+  loaders = calloc(nthreads, sizeof(Loader));
+  threads = malloc(nthreads * sizeof(pthread_t));
+  order = malloc((n ? n : 1) * sizeof(char*));
+
+  if (!loaders || !threads || !order)
+    ERROR(ENOMEM);
+
+  /* Paths with the same first component go to the same loader, so that the
+   * loaders build disjoint subtrees. Counted first, then placed in their
+   * order. */
+  for (size_t i = 0; i < n; ++i)
+    ++loaders[loader_of(paths[i], nthreads)].count;
+
+  for (unsigned i = 0; i < nthreads; ++i) {
+    loaders[i].tree = tree;
+    loaders[i].paths = order + total;
+    total += loaders[i].count;
+    loaders[i].count = 0;
+    loaders[i].top = new_dir(tree, ROOT_PATH, strlen(ROOT_PATH));
+
+    if (!loaders[i].top)
+      ERROR(ENOMEM);
   }
 
-  err = access_dir(tree, lca_path, lca, edit_entry, passedby, passed_count);
-  free(lca_path);
+  for (size_t i = 0; i < n; ++i) {
+    loader = &loaders[loader_of(paths[i], nthreads)];
+    loader->paths[loader->count++] = paths[i];
+  }
 
-  if (err)
-    return err;
+  /* the caller is one of the workers, it does the rest if threads fail */
+  while (started < nthreads - 1 &&
+         !pthread_create(&threads[started], NULL, bulk_worker,
+                         &loaders[started + 1]))
+    ++started;
 
-  /* Having locked the lca I am free to take the other two without locks */
-  err = access_dir(*lca, p1lca, t1, chill_entry, ignorepassed, &ignored);
-  assert(!err);
-  err = access_dir(*lca, p2lca, t2, chill_entry, ignorepassed, &ignored);
-  assert(!err);
+  bulk_worker(&loaders[0]);
 
-  return 0;
+  for (unsigned i = started + 1; i < nthreads; ++i)
+    bulk_worker(&loaders[i]);
+
+  for (unsigned i = 0; i < started; ++i) {
+    err = pthread_join(threads[i], NULL);
+    syserr(err, "tree_bulk_load: Failed to join a worker");
+  }
+
+  total = 0;
+
+  for (unsigned i = 0; i < nthreads; ++i) {
+    if (loaders[i].err)
+      ERROR(loaders[i].err);
+
+    total += hmap_size(&loaders[i].top->subdirs);
+  }
+
+  /* attach the top level directories, the root is sized for all of them */
+  if (!hmap_reserve(&tree->root->subdirs, total))
+    ERROR(ENOMEM);
+
+  for (unsigned i = 0; i < nthreads; ++i) {
+    it = hmap_iterator(&loaders[i].top->subdirs);
+
+    while (hmap_next(&loaders[i].top->subdirs, &it, &name, &child))
+      hmap_insert(&tree->root->subdirs, name, child);
+
+    free_dir(tree, loaders[i].top);
+    loaders[i].top = NULL;
+  }
+
+exiting:
+  free(loaders);
+  free(threads);
+  free(order);
+
+  /* whatever has been built is in the arena and goes along with it */
+  if (err) {
+    tree_free(tree);
+    errno = err;
+    return NULL;
+  }
+
+  return tree;
 }
 
-/* -------------------------------------------------------------------------- */
+/** Kinds of records in a tree's log, see `log_change`. */
+#define LOG_CREATE 'c'
+#define LOG_CREATE_PARENTS 'p'
+#define LOG_REMOVE 'r'
+#define LOG_REMOVE_RECURSIVE 'R'
+#define LOG_MOVE 'm'
 
-Tree* tree_new()
+int tree_log_start(Tree* tree, int fd, bool sync)
+{
+  if (tree->origin)
+    return EROFS;
+
+  if (tree->wal)
+    return EEXIST;
+
+  tree->wal = wal_open(fd);
+
+  if (!tree->wal)
+    return errno;
+
+  tree->wal_sync = sync;
+  return 0;
+}
+
+int tree_log_stop(Tree* tree)
 {
-  return new_dir(ROOT_PATH);
+  Wal* wal = tree->wal;
+
+  tree->wal = NULL;
+  return wal ? wal_close(wal) : 0;
 }
 
-void tree_free(Tree* tree)
+/**
+ * Append a change to the tree's log, if it has one: a kind and the path (paths
+ * for a move) it was made with, each null terminated. Called once the change
+ * cannot fail anymore but before it can be seen, that is before the `seq`
+ * write section of the change ends, even lockless walkers wait for that. So a
+ * change that depends on another one is always logged after it. Returns what
+ * to pass to `log_wait` once the locks are let go.
+ */
+static uint64_t log_change(Tree* tree, char kind, const char* path,
+                           const char* target)
 {
-  HashMapIterator it = hmap_iterator(tree->subdirs);
-  const char* subdir_name;
-  void* subdir_ptr;
-  Tree* subdir;
+  char rec[1 + 2 * (MAX_PATH_LEN + 1)];
+  size_t len = strlen(path) + 1;
 
-  /* freeing descendants first recursively */
-  while (hmap_next(tree->subdirs, &it, &subdir_name, &subdir_ptr)) {
-    subdir = (Tree*)subdir_ptr;
-    tree_free(subdir);
+  if (!tree->wal)
+    return 0;
+
+  rec[0] = kind;
+  memcpy(rec + 1, path, len);
+  ++len;
+
+  if (target) {
+    memcpy(rec + len, target, strlen(target) + 1);
+    len += strlen(target) + 1;
   }
 
-  monit_destroy(&tree->mon);
-  hmap_free(tree->subdirs);
-  free(tree->dir_name);
-  free(tree);
+  return wal_append(tree->wal, rec, len);
 }
 
-char* tree_list(Tree* tree, const char* path)
+/**
+ * Wait for a change `log_change` logged to be on disk if the log is
+ * synchronous. Called with no locks held. Returns 0 or the errno of the log.
+ */
+static int log_wait(Tree* tree, uint64_t pos)
 {
-  Tree* dir;
-  char* contents;
-  Monitor* passedby[MAX_PATH_LEN / 2];
-  size_t passed_count;
-  int err;
+  if (!pos || !tree->wal_sync)
+    return 0;
 
-  if (!is_path_valid(path))
-    return NULL;
+  return wal_wait(tree->wal, pos);
+}
 
-  err = access_dir(tree, path, &dir, list_entry, passedby, &passed_count);
+/** `wal_replay` callback of `tree_recover`, makes one logged change again. */
+static int replay_change(const void* rec, size_t len, void* arg)
+{
+  Tree* tree = arg;
+  const char* path = (const char*)rec + 1;
+  const char* end = (const char*)rec + len;
+  const char* target = memchr(path, '\0', end - path);
 
-  if (err || !dir) {
-    exit_monitors(passedby, passed_count, reader_exit);
-    return NULL;
-  }
+  if (!target)
+    return EINVAL;
+
+  /* the record ends with the last path */
+  if (++target == end)
+    target = NULL;
+  else if (!memchr(target, '\0', end - target) ||
+           target + strlen(target) + 1 != end)
+    return EINVAL;
 
-  contents = make_map_contents_string(dir->subdirs);
+  switch (*(const char*)rec) {
+    case LOG_CREATE:
+      return !target && !tree_create(tree, path) ? 0 : EINVAL;
+    case LOG_CREATE_PARENTS:
+      return !target && tree_create_parents(tree, path) > 0 ? 0 : EINVAL;
+    case LOG_REMOVE:
+      return !target && !tree_remove(tree, path) ? 0 : EINVAL;
+    case LOG_REMOVE_RECURSIVE:
+      return !target && !tree_remove_recursive(tree, path) ? 0 : EINVAL;
+    case LOG_MOVE:
+      return target && !tree_move(tree, path, target) ? 0 : EINVAL;
+    default:
+      return EINVAL;
+  }
+}
 
-  reader_exit(&dir->mon);
-  exit_monitors(passedby, passed_count, reader_exit);
+long tree_recover(Tree* tree, int log_fd)
+{
+  if (tree->origin)
+    return -EROFS;
 
-  return contents;
+  return wal_replay(log_fd, replay_change, tree);
 }
 
 int tree_create(Tree* tree, const char* path)
 {
-  Tree* parent;
-  Tree* subdir;
-  char* parent_path;
-  char last_component[MAX_DIR_NAME_LEN + 1];
+  PathView view;
+  Dir* parent;
+  Dir* subdir;
+  const char* name;
+  size_t len;
+  uint64_t logged = 0;
   int err = 0;
-  Monitor* passedby[MAX_PATH_LEN / 2];
-  size_t passed_count;
+  Dir* pinned[MAX_PATH_LEN / 2 + 1];
+  size_t pinned_count;
 
-  if (!is_path_valid(path))
+  if (!path_parse(path, &view))
     return EINVAL;
 
-  parent_path = make_path_to_parent(path, last_component);
+  if (tree->origin)
+    return EROFS;
 
   /* Create called on "/" -- the root already exists. */
-  if (!parent_path)
+  if (view.depth == 0)
     return EEXIST;
 
-  err = access_dir(tree, parent_path, &parent, edit_entry,
-                   passedby, &passed_count);
-  free(parent_path);
+  name = path_component(&view, view.depth - 1, &len);
+  err = access_dir(tree, &view, view.depth - 1, &parent, writer_entry,
+                   pinned, &pinned_count);
 
   if (err)
     ERROR(err);
@@ -311,44 +2821,189 @@ int tree_create(Tree* tree, const char* path)
     ERROR(ENOENT);
 
   /* The subdir we want to create already exists. */
-  if (hmap_get(parent->subdirs, last_component))
+  if (hmap_getn(&parent->subdirs, name, len))
     ERROR(EEXIST);
 
-  subdir = new_dir(last_component);
+  subdir = new_dir(tree, name, len);
 
   if (!subdir)
     ERROR(ENOMEM);
 
   /* Add the newly created subdirectory as a parent's child */
-  hmap_insert(parent->subdirs, subdir->dir_name, subdir);
+  seq_write_begin(&parent->seq);
+
+  if (!save_version(tree, parent, change_id(tree)) ||
+      !hmap_insert(&parent->subdirs, subdir->dir_name, subdir)) {
+    seq_write_end(&parent->seq);
+    free_dir(tree, subdir);
+    ERROR(ENOMEM);
+  }
+
+  drop_listing(parent);
+  logged = log_change(tree, LOG_CREATE, path, NULL);
+  seq_write_end(&parent->seq);
 
 exiting:
   if (parent)
     writer_exit(&parent->mon);
 
-  exit_monitors(passedby, passed_count, reader_exit);
-  return err;
+  unpin_dirs(pinned, pinned_count);
+  epoch_poll();
+  return err ? err : log_wait(tree, logged);
 }
 
-int tree_remove(Tree* tree, const char* path)
+/** Free a chain of new directories that `tree_create_parents` did not attach. */
+static void free_chain(Tree* tree, Dir* dir)
+{
+  HashMapIterator it;
+  const char* name;
+  void* child;
+
+  while (dir) {
+    it = hmap_iterator(&dir->subdirs);
+    child = NULL;
+    hmap_next(&dir->subdirs, &it, &name, &child);
+    free_dir(tree, dir);
+    dir = child;
+  }
+}
+
+int tree_create_parents(Tree* tree, const char* path)
+{
+  PathView view;
+  Dir* parent = NULL;
+  Dir* child;
+  Dir* chain = NULL;
+  Dir* next;
+  /* set before anything is missing, "/" never gets that far */
+  const char* name = NULL;
+  size_t len = 0;
+  size_t depth = 0;
+  uint64_t logged = 0;
+  int log_err;
+  int err = 0;
+  Dir* pinned[MAX_PATH_LEN / 2 + 1];
+  size_t pinned_count = 0;
+
+  if (!path_parse(path, &view))
+    return -EINVAL;
+
+  if (tree->origin)
+    return -EROFS;
+
+  pin_dir(tree->root, pinned, &pinned_count);
+  child = tree->root;
+
+  /* Walk down what exists like any other operation. Only where something is
+   * missing the parent gets locked, and if somebody has created it meanwhile
+   * the walk goes on from there. */
+  for (;;) {
+    while (child && depth < view.depth) {
+      parent = child;
+      name = path_component(&view, depth, &len);
+      pin_child(parent, name, len, false, &child);
+
+      if (child) {
+        pinned[pinned_count++] = child;
+        ++depth;
+      }
+    }
+
+    /* everything is there already */
+    if (child) {
+      parent = NULL;
+      goto exiting;
+    }
+
+    err = writer_entry(&parent->mon);
+
+    if (err) {
+      parent = NULL;
+      ERROR(-err);
+    }
+
+    child = hmap_getn(&parent->subdirs, name, len);
+
+    if (!child)
+      break;
+
+    pin_dir(child, pinned, &pinned_count);
+    writer_exit(&parent->mon);
+    ++depth;
+  }
+
+  /* The missing part is built aside, nobody can see it until it is attached
+   * as a whole. Its maps stay inline, so filling them does not fail. */
+  for (size_t i = view.depth; i --> depth; ) {
+    name = path_component(&view, i, &len);
+    next = new_dir(tree, name, len);
+
+    if (!next) {
+      free_chain(tree, chain);
+      ERROR(-ENOMEM);
+    }
+
+    if (chain)
+      hmap_insert(&next->subdirs, chain->dir_name, chain);
+
+    chain = next;
+  }
+
+  seq_write_begin(&parent->seq);
+
+  if (!save_version(tree, parent, change_id(tree)) ||
+      !hmap_insert(&parent->subdirs, chain->dir_name, chain)) {
+    seq_write_end(&parent->seq);
+    free_chain(tree, chain);
+    ERROR(-ENOMEM);
+  }
+
+  drop_listing(parent);
+
+  logged = log_change(tree, LOG_CREATE_PARENTS, path, NULL);
+  seq_write_end(&parent->seq);
+  err = view.depth - depth;
+
+exiting:
+  if (parent)
+    writer_exit(&parent->mon);
+
+  unpin_dirs(pinned, pinned_count);
+  epoch_poll();
+  log_err = log_wait(tree, logged);
+  return log_err ? -log_err : err;
+}
+
+/**
+ * Remove the directory a path leads to, with all of its contents if
+ * `recursive` is set. Returns some errno like `tree_remove`.
+ */
+static int remove_dir(Tree* tree, const char* path, bool recursive)
 {
-  Tree* parent;
-  Tree* subdir;
-  char* parent_path;
-  char last_component[MAX_DIR_NAME_LEN + 1];
+  PathView view;
+  Dir* parent;
+  Dir* subdir;
+  const char* name;
+  size_t len;
+  uint64_t id;
+  uint64_t logged = 0;
+  bool empty;
   int err = 0;
-  Monitor* passedby[MAX_PATH_LEN / 2];
-  size_t passed_count;
+  Dir* pinned[MAX_PATH_LEN / 2 + 1];
+  size_t pinned_count;
 
-  if (!is_path_valid(path))
+  if (!path_parse(path, &view))
     return EINVAL;
-  else if (strcmp(path, ROOT_PATH) == 0)
+  else if (tree->origin)
+    return EROFS;
+  else if (visiting == tree)
+    return EDEADLK;
+  else if (view.depth == 0)
     return EBUSY;
 
-  parent_path = make_path_to_parent(path, last_component);
-  err = access_dir(tree, parent_path, &parent, edit_entry,
-                   passedby, &passed_count);
-  free(parent_path);
+  name = path_component(&view, view.depth - 1, &len);
+  err = access_dir(tree, &view, view.depth - 1, &parent, writer_entry,
+                   pinned, &pinned_count);
 
   if (err)
     ERROR(err);
@@ -356,109 +3011,275 @@ int tree_remove(Tree* tree, const char* path)
   if (!parent)
     ERROR(ENOENT);
 
-  subdir = hmap_get(parent->subdirs, last_component);
+  subdir = hmap_getn(&parent->subdirs, name, len);
 
   if (!subdir)
     ERROR(ENOENT);
 
-  if (hmap_size(subdir->subdirs) > 0)
+  /* Nothing is changed for a directory that is not empty, nobody needs to back
+   * off. Its map stays as it is while it is read locked, and whoever holds its
+   * lock only waits for things below it, never for the parent. */
+  if (!recursive) {
+    err = reader_entry(&subdir->mon);
+    syserr(err, "remove_dir: Failed to enter a monitor");
+    empty = hmap_size(&subdir->subdirs) == 0;
+    err = reader_exit(&subdir->mon);
+    syserr(err, "remove_dir: Failed to exit a monitor");
+
+    if (!empty)
+      ERROR(ENOTEMPTY);
+  }
+
+  /* Operations that got into the subdir before we locked the parent may still
+   * be working in there (and may even create something). Once its counter
+   * moves new ones back off, whether they came through the parent or through
+   * the path cache, so wait for these to finish. The parent's counter is only
+   * moved after that: readers of the parent would wait for it and the waiting
+   * may take long. */
+  seq_write_begin(&subdir->detached);
+  pins_drain(&subdir->pins);
+
+  /* unless something got created in there since we looked */
+  if (!recursive && hmap_size(&subdir->subdirs) > 0) {
+    seq_write_end(&subdir->detached);
     ERROR(ENOTEMPTY);
+  }
+
+  /* nobody is below anymore, whatever is in there goes along with it */
+  seq_write_begin(&parent->seq);
+  id = change_id(tree);
+
+  if (!save_version(tree, parent, id)) {
+    seq_write_end(&subdir->detached);
+    seq_write_end(&parent->seq);
+    ERROR(ENOMEM);
+  }
 
-  hmap_remove(parent->subdirs, last_component);
-  tree_free(subdir);
+  drop_listing(parent);
+  hmap_remove(&parent->subdirs, subdir->dir_name);
+  seq_write_end(&subdir->detached);
+  logged = log_change(tree, recursive ? LOG_REMOVE_RECURSIVE : LOG_REMOVE,
+                      path, NULL);
+  seq_write_end(&parent->seq);
+  retire_subtree(tree, subdir, id);
 
 exiting:
   if (parent)
     writer_exit(&parent->mon);
 
-  exit_monitors(passedby, passed_count, reader_exit);
-  return err;
+  unpin_dirs(pinned, pinned_count);
+  epoch_poll();
+  return err ? err : log_wait(tree, logged);
+}
+
+int tree_remove(Tree* tree, const char* path)
+{
+  return remove_dir(tree, path, false);
+}
+
+int tree_remove_recursive(Tree* tree, const char* path)
+{
+  return remove_dir(tree, path, true);
 }
 
-/** The critical section of the moving process. */
-static int crit_tree_move(Tree* source_parent, Tree* target_parent,
-                          const char* source_dir_name,
-                          const char* target_dir_name)
+/**
+ * The critical section of the moving process. The source directory, called
+ * like the first `len` characters of `source_dir_name`, is detached, renamed
+ * in place to `*name` and attached under the target parent.
+ * On success `*name` is set to the old name, which lockless readers may still
+ * be comparing against, and the move of `source` to `target` is logged under
+ * `*logged`.
+ *
+ * Returns EAGAIN without changing anything if one of the `pinned` directories,
+ * the mover's own pins, is being detached by another mover: that one waits for
+ * our pins, while we might wait for its, so we are the ones to let go.
+ */
+static int crit_tree_move(Tree* tree, Dir* source_parent, Dir* target_parent,
+                          const char* source_dir_name, size_t len, char** name,
+                          const char* source, const char* target,
+                          Dir* const pinned[], size_t pinned_count,
+                          uint64_t* logged)
 {
-  Tree* target_dir;
-  HashMap* tmp;
-  Tree* source_dir = hmap_get(source_parent->subdirs, source_dir_name);
+  char* old_name;
+  uint64_t id;
+  uint32_t gen;
+  Dir* source_dir = hmap_getn(&source_parent->subdirs, source_dir_name, len);
 
   if (!source_dir)
     return ENOENT;
 
-  if (hmap_get(target_parent->subdirs, target_dir_name))
+  if (hmap_get(&target_parent->subdirs, *name))
     return EEXIST;
 
-  /* remove ourselves from one map and add to another */
-  hmap_remove(source_parent->subdirs, source_dir_name);
-  target_dir = new_dir(target_dir_name);
+  /* nothing has been changed yet */
+  if (!hmap_reserve(&target_parent->subdirs,
+                    hmap_size(&target_parent->subdirs) + 1))
+    return ENOMEM;
+
+  /* Operations working inside of the source started before the move and have
+   * to finish before it. New ones back off seeing the source's counter moved,
+   * however they came. The parents' counters are moved only after that, so
+   * that their readers never wait for the draining. */
+  seq_write_begin(&source_dir->detached);
+
+  /* Two moves each into the other's source would wait for each other's pins
+   * forever. Both of them marked their sources before looking, so at least one
+   * sees the other's mark. */
+  for (size_t i = 0; i < pinned_count; ++i)
+    if (!seq_read_try(&pinned[i]->detached, &gen)) {
+      seq_write_end(&source_dir->detached);
+      return EAGAIN;
+    }
+
+  pins_drain(&source_dir->pins);
+
+  /* lockless readers must not see the maps half way */
+  seq_write_begin(&source_parent->seq);
+
+  if (target_parent != source_parent)
+    seq_write_begin(&target_parent->seq);
+
+  /* a version saved for a move that does not happen is still the directory as
+   * it is */
+  id = change_id(tree);
 
-  if (!target_dir)
+  if (!save_version(tree, source_parent, id) ||
+      !save_version(tree, target_parent, id)) {
+    seq_write_end(&source_dir->detached);
+
+    if (target_parent != source_parent)
+      seq_write_end(&target_parent->seq);
+
+    seq_write_end(&source_parent->seq);
     return ENOMEM;
+  }
+
+  drop_listing(source_parent);
+  drop_listing(target_parent);
 
-  hmap_insert(target_parent->subdirs, target_dir->dir_name, target_dir);
+  /* detach, rename and attach, cannot fail with the space reserved; the
+   * source parent's map is not shrunk here, its next remove will do that */
+  hmap_remove_keep(&source_parent->subdirs, source_dir->dir_name);
+  old_name = source_dir->dir_name;
+  source_dir->dir_name = *name;
+  *name = old_name;
+  hmap_insert(&target_parent->subdirs, source_dir->dir_name, source_dir);
+  seq_write_end(&source_dir->detached);
+  *logged = log_change(tree, LOG_MOVE, source, target);
 
-  /* move the contents now and get rid of the old dir */
-  tmp = target_dir->subdirs;
-  target_dir->subdirs = source_dir->subdirs;
-  source_dir->subdirs = tmp;
-  tree_free(source_dir);
+  if (target_parent != source_parent)
+    seq_write_end(&target_parent->seq);
+
+  seq_write_end(&source_parent->seq);
 
   return 0;
 }
 
 int tree_move(Tree* tree, const char* source, const char* target)
 {
-  Tree* lca;
-  Tree* source_parent;
-  char* source_parent_path;
-  char source_name[MAX_DIR_NAME_LEN + 1];
-  Tree* target_parent;
-  char* target_parent_path;
-  char target_name[MAX_DIR_NAME_LEN + 1];
+  PathView source_view;
+  PathView target_view;
+  Dir* source_parent;
+  Dir* target_parent;
+  const char* source_name;
+  size_t source_len;
+  const char* target_name;
+  size_t target_len;
+  char* name;
+  uint64_t logged = 0;
   int err = 0;
-  Monitor* passedby[MAX_PATH_LEN / 2];
-  size_t passed_count;
+  /* the path to the lca and then both paths below it */
+  Dir* pinned[MAX_PATH_LEN + 2];
+  size_t pinned_count;
 
-  if (!is_path_valid(source) || !is_path_valid(target))
+  if (!path_parse(source, &source_view) || !path_parse(target, &target_view))
     return EINVAL;
-  else if (strcmp(source, ROOT_PATH) == 0)
+  else if (tree->origin)
+    return EROFS;
+  else if (visiting == tree)
+    return EDEADLK;
+  else if (source_view.depth == 0)
     return EBUSY;
   /* mv /a/b/ /a/b/c/ is stupid! */
   else if (is_proper_subpath(source, target))
     return ESUBPATH;
+  else if (target_view.depth == 0)
+    return EEXIST;
 
-  source_parent_path = make_path_to_parent(source, source_name);
-  target_parent_path = make_path_to_parent(target, target_name);
+  source_name = path_component(&source_view, source_view.depth - 1,
+                               &source_len);
+  target_name = path_component(&target_view, target_view.depth - 1,
+                               &target_len);
 
-  if (!target_parent_path) {
-    free(source_parent_path);
-    return EEXIST;
-  }
+  /* the new name is the only memory the move needs, get it before locking */
+  name = arena_strndup(tree->arena, target_name, target_len);
 
-  err = double_access(source_parent_path, target_parent_path, tree, &lca,
-                      &source_parent, &target_parent, passedby, &passed_count);
+  if (!name)
+    return ENOMEM;
 
-  free(source_parent_path);
-  free(target_parent_path);
+  for (;;) {
+    err = double_access(&source_view, source_view.depth - 1, &target_view,
+                        target_view.depth - 1, tree->root, &source_parent,
+                        &target_parent, pinned, &pinned_count);
 
-  if (err)
-    ERROR(err);
+    if (err)
+      ERROR(err);
 
-  if (!lca || !source_parent || !target_parent)
-    ERROR(ENOENT);
+    if (!source_parent || !target_parent)
+      ERROR(ENOENT);
 
-  err = crit_tree_move(source_parent, target_parent, source_name, target_name);
+    err = crit_tree_move(tree, source_parent, target_parent, source_name,
+                         source_len, &name, source, target, pinned,
+                         pinned_count, &logged);
+
+    if (err != EAGAIN)
+      break;
+
+    /* another move is in our way, let it finish */
+    writer_exit(&source_parent->mon);
+
+    if (target_parent != source_parent)
+      writer_exit(&target_parent->mon);
+
+    unpin_dirs(pinned, pinned_count);
+    sched_yield();
+  }
 
   if (err)
     ERROR(err);
 
 exiting:
-  /* only exiting the lca as we didn't lock others (we "chill_entered" them) */
-  if (lca)
-    writer_exit(&lca->mon);
+  if (source_parent)
+    writer_exit(&source_parent->mon);
 
-  exit_monitors(passedby, passed_count, reader_exit);
-  return err;
+  if (target_parent && target_parent != source_parent)
+    writer_exit(&target_parent->mon);
+
+  unpin_dirs(pinned, pinned_count);
+
+  /* either the unused new name or the replaced old one */
+  if (err)
+    arena_str_release(tree->arena, name);
+  else
+    retire_name(tree, name);
+
+  epoch_poll();
+  return err ? err : log_wait(tree, logged);
+}
+
+void tree_cache_stats(Tree* tree, TreeCacheStats* stats)
+{
+  PathCache* cache = (tree->origin ? tree->origin : tree)->cache;
+  CacheCounters* counters;
+
+  stats->hits = stats->misses = stats->invalidations = 0;
+
+  for (size_t i = 0; i < CACHE_STRIPES; ++i) {
+    counters = &cache->counters[i];
+    stats->hits += atomic_load_explicit(&counters->hits, memory_order_relaxed);
+    stats->misses += atomic_load_explicit(&counters->misses,
+                                          memory_order_relaxed);
+    stats->invalidations += atomic_load_explicit(&counters->invalidations,
+                                                 memory_order_relaxed);
+  }
 }
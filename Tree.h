@@ -4,6 +4,9 @@
 #ifndef _TREE_H_
 #define _TREE_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+
 /* CUSTOM ERROR CODES */
 
 /** Tried to move a directory into its descendant. */
@@ -18,16 +21,161 @@ Tree* tree_new(void);
 /** Free all of the memory stored by a tree. */
 void tree_free(Tree*);
 
+/** `tree_free` using up to `nthreads` threads, the calling one included. */
+void tree_free_parallel(Tree* tree, unsigned nthreads);
+
+/**
+ * Take a read-only snapshot of a tree in O(1). It shares all of its nodes with
+ * the tree: from then on a directory's children are copied only when it is
+ * changed for the first time, and removed directories are kept while the
+ * snapshot can see them. `tree_list` and `tree_list_range` on a snapshot never
+ * lock or wait for anything but a change in progress. Changes fail with
+ * EROFS, `tree_list_recursive` returns NULL and `tree_walk` ENOTSUP.
+ *
+ * A snapshot of a snapshot is the same snapshot again. Snapshots are freed
+ * with `tree_free`, all of them before the tree. Returns NULL if out of memory.
+ */
+Tree* tree_snapshot(Tree* tree);
+
+/**
+ * Write a tree to a file as it is at one moment, see `tree_snapshot`. Returns
+ * 0, ENOMEM or the errno of a failed write.
+ */
+int tree_save(Tree* tree, int fd);
+
+/**
+ * Make a new tree from a file written by `tree_save`. The file is mapped
+ * rather than read and the tree is built without any locking. Returns NULL
+ * with errno set if it cannot be mapped, EINVAL if it is not a saved tree or
+ * ENOMEM.
+ */
+Tree* tree_load(int fd);
+
+/**
+ * Make a new tree with the directories of `n` paths along with all of their
+ * ancestors, like `tree_create_parents` for each of them, but with up to
+ * `nthreads` threads, the calling one included. Paths are split between them
+ * by their first component and each thread builds its subtrees without any
+ * locking before they are attached to the root. Returns NULL with errno set to
+ * EINVAL if a path is invalid or ENOMEM.
+ */
+Tree* tree_bulk_load(const char* const* paths, size_t n, unsigned nthreads);
+
+/**
+ * Log every change made to a tree to `fd`, which must be an empty file, so
+ * that `tree_recover` can make them again after a crash. Records are written
+ * and synced in batches by a thread of the log. If `sync` is set, a change
+ * returns only once its record is on disk, otherwise it may still be in memory
+ * for a while. Returns EEXIST if the tree is logged already, EROFS for a
+ * snapshot, EINVAL if the file is not empty (truncate a log once the tree is
+ * saved anew), ENOMEM or the errno of writing to the file. Logging is started
+ * and stopped with no operations running.
+ *
+ * A change whose record could not be written still happens, then it returns
+ * the errno of the log (negated by `tree_create_parents`), and so do all the
+ * changes after it: the log ends there.
+ */
+int tree_log_start(Tree* tree, int fd, bool sync);
+
+/**
+ * Stop logging once every record is on disk. Returns 0 or the errno of a write
+ * or sync of the log that failed. `tree_free` stops it too.
+ */
+int tree_log_stop(Tree* tree);
+
+/**
+ * Make the changes of a log written by `tree_log_start` again, on a tree as it
+ * was when the log was started (eg. saved then and loaded with `tree_load`). A
+ * record cut short by a crash ends the log. Returns the number of changes
+ * made, -EINVAL if the file is not such a log or one of the changes does not
+ * fit the tree, -EROFS for a snapshot or minus the errno of reading the log.
+ */
+long tree_recover(Tree* tree, int log_fd);
+
 /** Return a comma separated list with all the subdirectories under a path. */
 char* tree_list(Tree* tree, const char* path);
 
+/**
+ * List the subdirectories under a path page by page. At most `limit` names
+ * that come after `after_name` in sorted order (all of them if it is NULL) are
+ * written comma separated and null terminated to `buf` of size `buflen`,
+ * fewer if they do not fit. Pass the last name of a page to get the next one.
+ *
+ * Returns the number of names written, 0 once there are no more. On error it
+ * is -EINVAL for an invalid path, -ENOENT if there is no such directory and
+ * -ERANGE if not even the next name fits.
+ */
+int tree_list_range(Tree* tree, const char* path, const char* after_name,
+                    size_t limit, char* buf, size_t buflen);
+
+/**
+ * Return a comma separated list with all the directories anywhere under a
+ * path, in preorder with siblings sorted. Each is given by its path below the
+ * listed one without the slashes at both ends, eg. "a,a/b,c" for "/" with
+ * "/a/", "/a/b/" and "/c/" in it. The whole subtree is listed as it was at one
+ * moment.
+ */
+char* tree_list_recursive(Tree* tree, const char* path);
+
+/**
+ * What `tree_walk` calls for every directory: with its full path, its depth
+ * (0 for the root) and the context given to `tree_walk`.
+ */
+typedef void TreeVisitor(const char* path, size_t depth, void* ctx);
+
+/**
+ * Visit every directory under a path, the path included, with up to
+ * `nthreads` threads, the calling one included. The visitor is called from all
+ * of them at once and in no particular order, a parent only before its
+ * children. Each directory is read locked only while its children are taken,
+ * so the walk is not a snapshot: changes made meanwhile may or may not be
+ * seen. Returns EINVAL, ENOENT, ENOMEM if some directories could not be
+ * visited, or 0.
+ *
+ * The visitor may use the walked tree, but not remove or move anything in it:
+ * the walk keeps the directories it has yet to finish pinned, so waiting for
+ * them to be let go from within would never end. `tree_remove`,
+ * `tree_remove_recursive` and `tree_move` return EDEADLK there instead.
+ */
+int tree_walk(Tree* tree, const char* path, TreeVisitor* visitor, void* ctx,
+              unsigned nthreads);
+
 /** Create a new subdirectory. */
 int tree_create(Tree* tree, const char* path);
 
+/**
+ * Create a directory along with any of its missing ancestors, like
+ * `mkdir -p`. The missing part appears at once. Returns the number of
+ * directories created, -EINVAL for an invalid path, -EROFS for a snapshot or
+ * -ENOMEM.
+ */
+int tree_create_parents(Tree* tree, const char* path);
+
 /** Remove a subdirectory. */
 int tree_remove(Tree* tree, const char* path);
 
+/**
+ * Remove a subdirectory along with everything in it, like `rm -r`. The
+ * subtree is unlinked at once and freed later off the critical path.
+ */
+int tree_remove_recursive(Tree* tree, const char* path);
+
 /** Move a soruce subdirectory to a new target location. */
 int tree_move(Tree* tree, const char* source, const char* target);
 
+/** How the path cache of a tree has done since it was made. */
+typedef struct TreeCacheStats {
+  /* lookups that found their path */
+  unsigned long hits;
+  unsigned long misses;
+  /* lookups that found their path cached but moved or removed since */
+  unsigned long invalidations;
+} TreeCacheStats;
+
+/**
+ * Read the counters of the cache that resolves deep paths in a single probe,
+ * the origin's for a snapshot. They are read one by one while operations go on.
+ */
+void tree_cache_stats(Tree* tree, TreeCacheStats* stats);
+
 #endif  /* _TREE_H_ */
@@ -0,0 +1,380 @@
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "arena.h"
+
+/** Number of free list shards. Threads are spread over them round-robin. */
+#define N_SHARDS 16
+
+/** String classes hold 8, 16, ..., ARENA_MAX_STR bytes. */
+#define MIN_STR_SHIFT 3
+#define N_STR_CLASSES 6
+
+/** The object class comes after the string classes. */
+#define OBJ_CLASS N_STR_CLASSES
+#define N_CLASSES (N_STR_CLASSES + 1)
+
+/** Workers of `arena_free_parallel` claim this many slabs at a time. */
+#define FREE_CHUNK 16
+
+/** Slabs hold at least this many bytes and at least SLAB_MIN_SLOTS slots. */
+#define SLAB_SIZE (16 * 1024)
+#define SLAB_MIN_SLOTS 32
+
+/** Every slot is aligned like this, which is enough for any object. */
+#define SLOT_ALIGN 16
+
+/** A slab's header, its slots follow right after. */
+typedef struct Slab {
+  struct Slab* next;
+  size_t used;
+} Slab;
+
+#define SLAB_HEADER ((sizeof(Slab) + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN)
+
+/** Where released slots keep the link to the next free one. */
+typedef struct FreeSlot {
+  struct FreeSlot* next;
+} FreeSlot;
+
+typedef struct Shard {
+  alignas(64) pthread_mutex_t lock;
+  FreeSlot* free[N_CLASSES];
+  /* the slab currently being carved is the head of the list */
+  Slab* slabs[N_CLASSES];
+} Shard;
+
+struct Arena {
+  size_t slot_size[N_CLASSES];
+  size_t slab_size[N_CLASSES];
+  int (*ctor)(void*);
+  void (*dtor)(void*);
+  Shard shards[N_SHARDS];
+};
+
+/** Round-robin source of shard numbers for new threads. */
+static atomic_uint next_shard;
+
+/** This thread's shard number plus one, zero if not chosen yet. */
+static _Thread_local unsigned my_shard;
+
+static Shard* get_shard(Arena* arena)
+{
+  if (!my_shard)
+    my_shard = atomic_fetch_add(&next_shard, 1) % N_SHARDS + 1;
+
+  return &arena->shards[my_shard - 1];
+}
+
+static size_t str_class(size_t len)
+{
+  size_t class = 0;
+
+  while (((size_t)1 << (class + MIN_STR_SHIFT)) < len)
+    ++class;
+
+  return class;
+}
+
+Arena* arena_new(size_t obj_size, int ctor(void*), void dtor(void*))
+{
+  Arena* arena = malloc(sizeof(Arena));
+  int err;
+
+  if (!arena)
+    return NULL;
+
+  for (size_t class = 0; class < N_CLASSES; ++class) {
+    size_t size = class == OBJ_CLASS ? obj_size : 1 << (class + MIN_STR_SHIFT);
+    size_t slab;
+
+    size = (size + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+    slab = SLAB_HEADER + SLAB_MIN_SLOTS * size;
+    arena->slot_size[class] = size;
+    arena->slab_size[class] = slab > SLAB_SIZE ? slab : SLAB_SIZE;
+  }
+
+  arena->ctor = ctor;
+  arena->dtor = dtor;
+
+  for (size_t i = 0; i < N_SHARDS; ++i) {
+    Shard* shard = &arena->shards[i];
+
+    if ((err = pthread_mutex_init(&shard->lock, 0))) {
+      while (i --> 0)
+        pthread_mutex_destroy(&arena->shards[i].lock);
+
+      free(arena);
+      return NULL;
+    }
+
+    memset(shard->free, 0, sizeof(shard->free));
+    memset(shard->slabs, 0, sizeof(shard->slabs));
+  }
+
+  return arena;
+}
+
+/** Destroy the objects of a slab of a given class and free it. */
+static void free_slab(Arena* arena, Slab* slab, size_t class)
+{
+  size_t size = arena->slot_size[class];
+  char* slots = (char*)slab + SLAB_HEADER;
+
+  if (class == OBJ_CLASS && arena->dtor)
+    for (size_t off = 0; off < slab->used; off += size)
+      arena->dtor(slots + off);
+
+  free(slab);
+}
+
+/** Free what is left of an arena once its slabs are gone. */
+static void free_shards(Arena* arena)
+{
+  for (size_t i = 0; i < N_SHARDS; ++i)
+    pthread_mutex_destroy(&arena->shards[i].lock);
+
+  free(arena);
+}
+
+void arena_free(Arena* arena)
+{
+  for (size_t i = 0; i < N_SHARDS; ++i) {
+    Shard* shard = &arena->shards[i];
+
+    for (size_t class = 0; class < N_CLASSES; ++class) {
+      for (Slab* slab = shard->slabs[class]; slab;) {
+        Slab* next = slab->next;
+
+        free_slab(arena, slab, class);
+        slab = next;
+      }
+    }
+  }
+
+  free_shards(arena);
+}
+
+/** The slabs `arena_free_parallel` shares out, with their classes. */
+typedef struct Sweep {
+  Arena* arena;
+  Slab** slabs;
+  unsigned char* classes;
+  size_t count;
+  atomic_size_t next;
+} Sweep;
+
+/** A worker of `arena_free_parallel`, claims chunks of slabs until none are
+ * left, so that the faster ones take over the rest of the work. */
+static void* sweep_worker(void* arg)
+{
+  Sweep* sweep = arg;
+  size_t begin;
+  size_t end;
+
+  while ((begin = atomic_fetch_add(&sweep->next, FREE_CHUNK)) < sweep->count) {
+    end = begin + FREE_CHUNK < sweep->count ? begin + FREE_CHUNK : sweep->count;
+
+    for (size_t i = begin; i < end; ++i)
+      free_slab(sweep->arena, sweep->slabs[i], sweep->classes[i]);
+  }
+
+  return NULL;
+}
+
+void arena_free_parallel(Arena* arena, unsigned nthreads)
+{
+  pthread_t* threads;
+  unsigned started = 0;
+  Sweep sweep;
+  size_t n = 0;
+  int err;
+
+  sweep.count = 0;
+
+  for (size_t i = 0; i < N_SHARDS; ++i)
+    for (size_t class = 0; class < N_CLASSES; ++class)
+      for (Slab* slab = arena->shards[i].slabs[class]; slab; slab = slab->next)
+        ++sweep.count;
+
+  if (nthreads > sweep.count / FREE_CHUNK)
+    nthreads = sweep.count / FREE_CHUNK;
+
+  sweep.slabs = malloc(sweep.count * sizeof(Slab*));
+  sweep.classes = malloc(sweep.count);
+  threads = malloc(nthreads * sizeof(pthread_t));
+
+  /* not worth it or no memory to do it, do it the simple way */
+  if (nthreads <= 1 || !sweep.slabs || !sweep.classes || !threads) {
+    free(sweep.slabs);
+    free(sweep.classes);
+    free(threads);
+    arena_free(arena);
+    return;
+  }
+
+  for (size_t i = 0; i < N_SHARDS; ++i) {
+    for (size_t class = 0; class < N_CLASSES; ++class) {
+      for (Slab* slab = arena->shards[i].slabs[class]; slab; slab = slab->next) {
+        sweep.slabs[n] = slab;
+        sweep.classes[n++] = class;
+      }
+    }
+  }
+
+  sweep.arena = arena;
+  atomic_init(&sweep.next, 0);
+
+  /* the caller is one of the workers, fewer threads just mean less help */
+  while (started < nthreads - 1 &&
+         !pthread_create(&threads[started], NULL, sweep_worker, &sweep))
+    ++started;
+
+  sweep_worker(&sweep);
+
+  for (unsigned i = 0; i < started; ++i) {
+    err = pthread_join(threads[i], NULL);
+    syserr(err, "arena free, join");
+  }
+
+  free(sweep.slabs);
+  free(sweep.classes);
+  free(threads);
+  free_shards(arena);
+}
+
+/**
+ * Take over the free slots of a class some other shard has, the own `shard`
+ * must be locked. Slots are released to the releasing thread's shard, which
+ * may never allocate (eg. the epoch's background reclaimer), so they would
+ * pile up there. The other shards are only tried, never waited for.
+ */
+static void shard_steal(Arena* arena, Shard* shard, size_t class)
+{
+  size_t own = shard - arena->shards;
+  Shard* other;
+  int err;
+
+  for (size_t i = 1; i < N_SHARDS && !shard->free[class]; ++i) {
+    other = &arena->shards[(own + i) % N_SHARDS];
+
+    if (pthread_mutex_trylock(&other->lock))
+      continue;
+
+    shard->free[class] = other->free[class];
+    other->free[class] = NULL;
+    err = pthread_mutex_unlock(&other->lock);
+    syserr(err, "arena steal, mutex unlock");
+  }
+}
+
+/** Take a slot of a given class, the shard must be locked. */
+static void* shard_alloc(Arena* arena, Shard* shard, size_t class)
+{
+  size_t size = arena->slot_size[class];
+  size_t capacity = arena->slab_size[class] - SLAB_HEADER;
+  FreeSlot* slot = shard->free[class];
+  Slab* slab = shard->slabs[class];
+  void* obj;
+
+  /* rather than carving a new slab */
+  if (!slot && (!slab || slab->used + size > capacity)) {
+    shard_steal(arena, shard, class);
+    slot = shard->free[class];
+  }
+
+  if (slot) {
+    shard->free[class] = slot->next;
+    return slot;
+  }
+
+  if (!slab || slab->used + size > capacity) {
+    slab = malloc(arena->slab_size[class]);
+
+    if (!slab)
+      return NULL;
+
+    slab->used = 0;
+    slab->next = shard->slabs[class];
+    shard->slabs[class] = slab;
+  }
+
+  obj = (char*)slab + SLAB_HEADER + slab->used;
+
+  if (class == OBJ_CLASS && arena->ctor && arena->ctor(obj))
+    return NULL;
+
+  slab->used += size;
+  return obj;
+}
+
+/** Give back a slot of a given class to the calling thread's shard. */
+static void shard_release(Arena* arena, size_t class, void* obj)
+{
+  Shard* shard = get_shard(arena);
+  FreeSlot* slot = obj;
+  int err;
+
+  err = pthread_mutex_lock(&shard->lock);
+  syserr(err, "arena release, mutex lock");
+  slot->next = shard->free[class];
+  shard->free[class] = slot;
+  err = pthread_mutex_unlock(&shard->lock);
+  syserr(err, "arena release, mutex unlock");
+}
+
+static void* class_alloc(Arena* arena, size_t class)
+{
+  Shard* shard = get_shard(arena);
+  void* obj;
+  int err;
+
+  err = pthread_mutex_lock(&shard->lock);
+  syserr(err, "arena alloc, mutex lock");
+  obj = shard_alloc(arena, shard, class);
+  err = pthread_mutex_unlock(&shard->lock);
+  syserr(err, "arena alloc, mutex unlock");
+
+  return obj;
+}
+
+void* arena_alloc(Arena* arena)
+{
+  return class_alloc(arena, OBJ_CLASS);
+}
+
+void arena_release(Arena* arena, void* obj)
+{
+  shard_release(arena, OBJ_CLASS, obj);
+}
+
+char* arena_strdup(Arena* arena, const char* str)
+{
+  return arena_strndup(arena, str, strlen(str));
+}
+
+char* arena_strndup(Arena* arena, const char* str, size_t len)
+{
+  char* copy;
+
+  if (len + 1 > ARENA_MAX_STR)
+    return NULL;
+
+  copy = class_alloc(arena, str_class(len + 1));
+
+  if (copy) {
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+  }
+
+  return copy;
+}
+
+void arena_str_release(Arena* arena, char* str)
+{
+  shard_release(arena, str_class(strlen(str) + 1), str);
+}
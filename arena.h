@@ -0,0 +1,62 @@
+/**
+ * An interface for a slab allocator serving one directory tree.
+ *
+ * The arena hands out fixed-size objects (the tree's nodes) and short strings
+ * (the directory names). Memory is carved out of big slabs and recycled
+ * through free lists. The free lists are sharded and each thread sticks to one
+ * shard, so threads rarely contend over an allocation.
+ *
+ * Objects are cached in their constructed state, like in Bonwick's slab
+ * allocator: `ctor` runs once when a slot is first carved out of a slab and
+ * `dtor` runs once for every carved slot when the whole arena is freed, no
+ * matter whether the slot was released in the meantime. A released object is
+ * therefore expected to be left in its constructed state. The arena overwrites
+ * only the first pointer-sized word of a released object.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/** Longest string (including the terminating null character) `arena_strdup`
+ * can hold. */
+#define ARENA_MAX_STR 256
+
+typedef struct Arena Arena;
+
+/**
+ * Create a new arena for objects of `obj_size` bytes. `ctor` returns 0 or an
+ * errno value, `ctor` and `dtor` may be NULL. Returns NULL if out of memory.
+ */
+Arena* arena_new(size_t obj_size, int ctor(void*), void dtor(void*));
+
+/**
+ * Release all of the memory of an arena at once, running `dtor` on each object.
+ * Must not run concurrently with any other use of the arena.
+ */
+void arena_free(Arena* arena);
+
+/**
+ * `arena_free` with the work split between the calling thread and up to
+ * `nthreads - 1` helper threads. Small arenas are freed by the caller alone.
+ */
+void arena_free_parallel(Arena* arena, unsigned nthreads);
+
+/** Get a constructed object, or NULL if out of memory. */
+void* arena_alloc(Arena* arena);
+
+/** Give an object back to the arena. */
+void arena_release(Arena* arena, void* obj);
+
+/** Copy a string of at most ARENA_MAX_STR bytes into the arena. */
+char* arena_strdup(Arena* arena, const char* str);
+
+/** Copy the first `len` characters of `str` as a null-terminated string, like
+ * `arena_strdup`. */
+char* arena_strndup(Arena* arena, const char* str, size_t len);
+
+/** Give back a string obtained from `arena_strdup` or `arena_strndup`. */
+void arena_str_release(Arena* arena, char* str);
+
+#endif  /* _ARENA_H_ */
@@ -0,0 +1,366 @@
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "err.h"
+#include "epoch.h"
+
+/** Number of reader count stripes. Threads are spread over them round-robin. */
+#define N_STRIPES 32
+
+/** `epoch_poll` reclaims once this many calls are queued. */
+#define POLL_THRESHOLD 64
+
+/** The reclaimer also takes whatever is queued after this many ms. */
+#define RECLAIMER_PERIOD_MS 100
+
+/** Number of retired calls that can be queued without any memory. */
+#define N_RESERVED 64
+
+/**
+ * Readers of an epoch are counted under its parity, the grace period ends
+ * when the counts of the parity of the previous epoch drop to zero.
+ */
+typedef struct Stripe {
+  alignas(64) atomic_ulong active[2];
+} Stripe;
+
+typedef struct Retired {
+  struct Retired* next;
+  void* ptr;
+  void (*fn)(void*, void*);
+  void* arg;
+  /* one of `reserved`, given back instead of freed */
+  bool reserved;
+} Retired;
+
+static atomic_uint epoch;
+static Stripe stripes[N_STRIPES];
+
+/** Round-robin source of stripe numbers for new threads. */
+static atomic_uint next_stripe;
+
+/** This thread's stripe number plus one, zero if not chosen yet. */
+static _Thread_local unsigned my_stripe;
+
+/**
+ * Retired calls waiting for a grace period. Any thread pushes, the reclaimer
+ * of the moment takes the whole list at once, so there is no ABA.
+ */
+static _Atomic(Retired*) pending;
+static atomic_size_t pending_count;
+
+/**
+ * What `epoch_retire` takes when malloc fails. Waiting for a grace period
+ * instead could wait for a reader that waits for the caller, who may be in
+ * the middle of a seq write section.
+ */
+static Retired reserved[N_RESERVED];
+static atomic_bool reserved_taken[N_RESERVED];
+
+/** Only one thread reclaims at a time. */
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The background reclaimer, see `epoch_reclaimer_start`. It is started and
+ * stopped under `reclaimer_control`, `reclaimer_lock` goes with its condition
+ * variable. */
+static pthread_mutex_t reclaimer_control = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t reclaimer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaimer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t reclaimer;
+static bool reclaimer_stop;
+static atomic_bool reclaimer_running;
+/* set by `epoch_poll` so that it signals only once per batch */
+static atomic_bool reclaimer_kicked;
+
+unsigned epoch_enter(void)
+{
+  unsigned stripe;
+  unsigned e;
+
+  if (!my_stripe)
+    my_stripe = atomic_fetch_add(&next_stripe, 1) % N_STRIPES + 1;
+
+  stripe = my_stripe - 1;
+
+  /* if the epoch moved on before we got counted, the reclaimer may not have
+   * seen us, count again under the new one */
+  for (;;) {
+    e = atomic_load(&epoch) & 1;
+    atomic_fetch_add(&stripes[stripe].active[e], 1);
+
+    if ((atomic_load(&epoch) & 1) == e)
+      return stripe << 1 | e;
+
+    atomic_fetch_sub(&stripes[stripe].active[e], 1);
+  }
+}
+
+void epoch_exit(unsigned token)
+{
+  atomic_fetch_sub(&stripes[token >> 1].active[token & 1], 1);
+}
+
+/** Start a new epoch and wait for the readers of the old one to leave. */
+static void synchronize(void)
+{
+  unsigned old = atomic_fetch_add(&epoch, 1) & 1;
+
+  for (size_t i = 0; i < N_STRIPES; ++i)
+    while (atomic_load(&stripes[i].active[old]) != 0)
+      sched_yield();
+}
+
+/** Take everything retired so far and run it after a grace period. The
+ * `reclaim_lock` must be held. */
+static void reclaim(void)
+{
+  Retired* list = atomic_exchange(&pending, NULL);
+  Retired* next;
+  size_t count = 0;
+
+  if (!list)
+    return;
+
+  synchronize();
+
+  for (; list; list = next) {
+    next = list->next;
+    list->fn(list->ptr, list->arg);
+
+    if (list->reserved)
+      atomic_store(&reserved_taken[list - reserved], false);
+    else
+      free(list);
+
+    ++count;
+  }
+
+  atomic_fetch_sub(&pending_count, count);
+}
+
+/** A free one of `reserved`, NULL if all of them are queued. */
+static Retired* take_reserved(void)
+{
+  for (size_t i = 0; i < N_RESERVED; ++i)
+    if (!atomic_load(&reserved_taken[i]) &&
+        !atomic_exchange(&reserved_taken[i], true))
+      return &reserved[i];
+
+  return NULL;
+}
+
+void epoch_retire(void* ptr, void fn(void* ptr, void* arg), void* arg)
+{
+  Retired* retired = malloc(sizeof(Retired));
+
+  if (retired) {
+    retired->reserved = false;
+  } else {
+    retired = take_reserved();
+
+    /* never running the call is always safe, only memory is lost */
+    if (!retired)
+      return;
+
+    retired->reserved = true;
+  }
+
+  retired->ptr = ptr;
+  retired->fn = fn;
+  retired->arg = arg;
+  retired->next = atomic_load_explicit(&pending, memory_order_relaxed);
+
+  /* counted first so that the count never drops below zero in `reclaim` */
+  atomic_fetch_add(&pending_count, 1);
+
+  while (!atomic_compare_exchange_weak_explicit(&pending, &retired->next,
+                                                retired, memory_order_release,
+                                                memory_order_relaxed))
+    ;
+}
+
+static void free_fn(void* ptr, void* arg)
+{
+  (void)arg;
+  free(ptr);
+}
+
+void epoch_defer_free(void* ptr)
+{
+  epoch_retire(ptr, free_fn, NULL);
+}
+
+void epoch_poll(void)
+{
+  int err;
+
+  if (atomic_load(&pending_count) < POLL_THRESHOLD)
+    return;
+
+  /* leave it to the reclaimer, wake it up if nobody has yet */
+  if (atomic_load(&reclaimer_running)) {
+    if (atomic_exchange(&reclaimer_kicked, true))
+      return;
+
+    err = pthread_mutex_lock(&reclaimer_lock);
+    syserr(err, "epoch poll, mutex lock");
+    err = pthread_cond_signal(&reclaimer_wake);
+    syserr(err, "epoch poll, cond signal");
+    err = pthread_mutex_unlock(&reclaimer_lock);
+    syserr(err, "epoch poll, mutex unlock");
+    return;
+  }
+
+  /* somebody else is on it already */
+  if (pthread_mutex_trylock(&reclaim_lock))
+    return;
+
+  reclaim();
+  err = pthread_mutex_unlock(&reclaim_lock);
+  syserr(err, "epoch poll, mutex unlock");
+}
+
+void epoch_barrier(void)
+{
+  int err;
+
+  err = pthread_mutex_lock(&reclaim_lock);
+  syserr(err, "epoch barrier, mutex lock");
+  reclaim();
+  err = pthread_mutex_unlock(&reclaim_lock);
+  syserr(err, "epoch barrier, mutex unlock");
+}
+
+/** The reclaimer thread: wait for a batch or a period, reclaim, repeat. */
+static void* reclaimer_main(void* arg)
+{
+  struct timespec deadline;
+  bool stop = false;
+  int err;
+
+  (void)arg;
+
+  while (!stop) {
+    err = pthread_mutex_lock(&reclaimer_lock);
+    syserr(err, "epoch reclaimer, mutex lock");
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += RECLAIMER_PERIOD_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    while (!reclaimer_stop &&
+           atomic_load(&pending_count) < POLL_THRESHOLD) {
+      err = pthread_cond_timedwait(&reclaimer_wake, &reclaimer_lock,
+                                   &deadline);
+
+      if (err == ETIMEDOUT)
+        break;
+
+      syserr(err, "epoch reclaimer, cond wait");
+    }
+
+    stop = reclaimer_stop;
+    err = pthread_mutex_unlock(&reclaimer_lock);
+    syserr(err, "epoch reclaimer, mutex unlock");
+
+    atomic_store(&reclaimer_kicked, false);
+    err = pthread_mutex_lock(&reclaim_lock);
+    syserr(err, "epoch reclaimer, mutex lock");
+    reclaim();
+    err = pthread_mutex_unlock(&reclaim_lock);
+    syserr(err, "epoch reclaimer, mutex unlock");
+  }
+
+  return NULL;
+}
+
+int epoch_reclaimer_start(void)
+{
+  int result = EEXIST;
+  int err;
+
+  err = pthread_mutex_lock(&reclaimer_control);
+  syserr(err, "epoch reclaimer start, mutex lock");
+
+  if (!atomic_load(&reclaimer_running)) {
+    reclaimer_stop = false;
+    atomic_store(&reclaimer_kicked, false);
+    result = pthread_create(&reclaimer, NULL, reclaimer_main, NULL);
+
+    if (!result)
+      atomic_store(&reclaimer_running, true);
+  }
+
+  err = pthread_mutex_unlock(&reclaimer_control);
+  syserr(err, "epoch reclaimer start, mutex unlock");
+  return result;
+}
+
+void epoch_reclaimer_stop(void)
+{
+  int err;
+
+  err = pthread_mutex_lock(&reclaimer_control);
+  syserr(err, "epoch reclaimer stop, mutex lock");
+
+  if (atomic_load(&reclaimer_running)) {
+    err = pthread_mutex_lock(&reclaimer_lock);
+    syserr(err, "epoch reclaimer stop, mutex lock");
+    reclaimer_stop = true;
+    err = pthread_cond_signal(&reclaimer_wake);
+    syserr(err, "epoch reclaimer stop, cond signal");
+    err = pthread_mutex_unlock(&reclaimer_lock);
+    syserr(err, "epoch reclaimer stop, mutex unlock");
+
+    /* it reclaims once more on its way out */
+    err = pthread_join(reclaimer, NULL);
+    syserr(err, "epoch reclaimer stop, join");
+    atomic_store(&reclaimer_running, false);
+  }
+
+  err = pthread_mutex_unlock(&reclaimer_control);
+  syserr(err, "epoch reclaimer stop, mutex unlock");
+}
+
+void seq_init(Seq* seq)
+{
+  atomic_init(seq, 0);
+}
+
+void seq_write_begin(Seq* seq)
+{
+  atomic_fetch_add_explicit(seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void seq_write_end(Seq* seq)
+{
+  atomic_fetch_add_explicit(seq, 1, memory_order_release);
+}
+
+uint32_t seq_read_begin(Seq* seq)
+{
+  uint32_t start;
+
+  while ((start = atomic_load_explicit(seq, memory_order_acquire)) & 1)
+    sched_yield();
+
+  return start;
+}
+
+bool seq_read_try(Seq* seq, uint32_t* start)
+{
+  *start = atomic_load_explicit(seq, memory_order_acquire);
+  return !(*start & 1);
+}
+
+bool seq_read_valid(Seq* seq, uint32_t start)
+{
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(seq, memory_order_relaxed) == start;
+}
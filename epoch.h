@@ -0,0 +1,98 @@
+/**
+ * An interface for lockless reading: epoch based reclamation and sequence
+ * counters.
+ *
+ * Readers wrap their lockless accesses in `epoch_enter`/`epoch_exit`. Memory a
+ * reader might still be looking at is not freed right away but handed to
+ * `epoch_retire`, which frees it once every read section that was running at
+ * that moment has ended (a grace period).
+ *
+ * The epoch is process wide, so memory of any structure may be retired and
+ * waiting for grace periods never depends on which structure a reader uses.
+ * Readers are counted on per-thread stripes so that entering and leaving does
+ * not bounce a shared cache line between cores. Retiring is a lock-free push,
+ * so it is cheap enough for critical sections.
+ *
+ * Sequence counters let a reader check that a bunch of lockless reads saw a
+ * consistent state: writers (already serialised by some lock) make the counter
+ * odd while they modify and readers retry if it changed under them.
+ */
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Enter a read section, returns a token for `epoch_exit`. May be nested. */
+unsigned epoch_enter(void);
+
+/** Leave the read section `token` was returned for. */
+void epoch_exit(unsigned token);
+
+/**
+ * Call `fn(ptr, arg)` once the current grace period is over. Must be called
+ * after `ptr` has been made unreachable for new readers. Never waits, so it
+ * may be called from anywhere, read and seq write sections included. If there
+ * is no memory to queue the call, one of a few reserved entries is used; with
+ * those gone too the call is dropped and `ptr` is never reclaimed.
+ */
+void epoch_retire(void* ptr, void fn(void* ptr, void* arg), void* arg);
+
+/** `epoch_retire` memory that should just be `free`d. */
+void epoch_defer_free(void* ptr);
+
+/**
+ * Run the retired calls whose grace period is over if enough of them piled up.
+ * Cheap when there is nothing to do. Must not be called from within a read
+ * section nor while holding locks readers might wait for.
+ */
+void epoch_poll(void);
+
+/**
+ * Wait for a grace period and run every call retired before this one. Same
+ * restrictions as `epoch_poll`. Also the way to flush what the reclaimer has
+ * not got to yet.
+ */
+void epoch_barrier(void);
+
+/**
+ * Start a background thread that runs the retired calls in batches, then
+ * `epoch_poll` only wakes it up instead of reclaiming on the caller's thread.
+ * Whatever is queued gets reclaimed at least every so often even without
+ * polling. Returns EEXIST if it is running already or an error of
+ * pthread_create.
+ */
+int epoch_reclaimer_start(void);
+
+/** Stop the background reclaimer after it reclaims what is queued. */
+void epoch_reclaimer_stop(void);
+
+/** A sequence counter. */
+typedef _Atomic uint32_t Seq;
+
+/** Initialise a sequence counter. */
+void seq_init(Seq* seq);
+
+/**
+ * Start a modification. Writers must be serialised. It is a full barrier, so
+ * a reader that wrote something and then checks the counter either sees the
+ * modification started or its write is seen by the writer's later reads.
+ */
+void seq_write_begin(Seq* seq);
+
+/** Finish a modification. */
+void seq_write_end(Seq* seq);
+
+/** Start reading, waits for a writer in progress. Returns the value to check. */
+uint32_t seq_read_begin(Seq* seq);
+
+/** Like `seq_read_begin` but returns false instead of waiting. */
+bool seq_read_try(Seq* seq, uint32_t* start);
+
+/** Tell whether the reads since `seq_read_begin` returned `start` were
+ * consistent. */
+bool seq_read_valid(Seq* seq, uint32_t start);
+
+#endif  /* _EPOCH_H_ */
@@ -0,0 +1,166 @@
+/**
+ * Listing throughput with writers running at the same time.
+ *
+ * Usage: list_bench [max readers] [writers] [seconds] [reclaimer]
+ *
+ * For 1, 2, 4, ... up to `max readers` reader threads it prints how many
+ * `tree_list` calls per second they managed in total while `writers` threads
+ * kept creating, removing and moving directories next to the listed ones, and
+ * how many of those changes succeeded.
+ * With `reclaimer` set to 1, retired nodes, names and listings are reclaimed by
+ * the background reclaimer instead of by the writers.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "epoch.h"
+#include "err.h"
+#include "Tree.h"
+
+#define MAX_THREADS 256
+
+/** Directories the writers play with under "/w/", called 'a' and on. */
+#define N_NAMES 26
+
+static Tree* tree;
+static atomic_bool stop;
+
+/** Changes the writers actually made, failed ones are not counted. */
+static atomic_ulong changes;
+
+static void* writer(void* arg)
+{
+  unsigned seed = (unsigned)(size_t)arg;
+  unsigned long count = 0;
+  char path[32];
+  char target[32];
+  int err;
+
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    sprintf(path, "/w/%c/", 'a' + rand_r(&seed) % N_NAMES);
+    sprintf(target, "/w/%c/%c/", 'a' + rand_r(&seed) % N_NAMES,
+            'a' + rand_r(&seed) % N_NAMES);
+
+    switch (rand_r(&seed) % 4) {
+      case 0:
+        err = tree_create(tree, path);
+        break;
+      case 1:
+        err = tree_remove(tree, path);
+        break;
+      case 2:
+        /* whole subtrees the moves have built go to the reclaimer too */
+        err = tree_remove_recursive(tree, path);
+        break;
+      default:
+        err = tree_move(tree, path, target);
+        break;
+    }
+
+    if (!err)
+      ++count;
+  }
+
+  atomic_fetch_add(&changes, count);
+  return NULL;
+}
+
+static void* reader(void* arg)
+{
+  /* the listed paths share their ancestors with the writers' ones */
+  static const char* paths[] = { "/", "/r/", "/r/a/", "/w/" };
+  unsigned long count = 0;
+
+  (void)arg;
+
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    free(tree_list(tree, paths[count % 4]));
+    ++count;
+  }
+
+  return (void*)count;
+}
+
+static void run(int readers, int writers, double seconds)
+{
+  pthread_t threads[2 * MAX_THREADS];
+  struct timespec duration;
+  unsigned long total = 0;
+  void* count;
+  int err;
+
+  duration.tv_sec = (time_t)seconds;
+  duration.tv_nsec = (long)((seconds - duration.tv_sec) * 1e9);
+  atomic_store(&stop, false);
+  atomic_store(&changes, 0);
+
+  for (int i = 0; i < writers; ++i) {
+    err = pthread_create(&threads[i], NULL, writer, (void*)(size_t)(i + 1));
+    syserr(err, "list_bench: pthread_create");
+  }
+
+  for (int i = 0; i < readers; ++i) {
+    err = pthread_create(&threads[writers + i], NULL, reader, NULL);
+    syserr(err, "list_bench: pthread_create");
+  }
+
+  nanosleep(&duration, NULL);
+  atomic_store(&stop, true);
+
+  for (int i = 0; i < writers + readers; ++i) {
+    err = pthread_join(threads[i], &count);
+    syserr(err, "list_bench: pthread_join");
+
+    if (i >= writers)
+      total += (unsigned long)count;
+  }
+
+  printf("%3d readers, %d writers: %12.0f lists/s %10.0f changes/s\n",
+         readers, writers, total / seconds, atomic_load(&changes) / seconds);
+}
+
+int main(int argc, char* argv[])
+{
+  int max_readers = argc > 1 ? atoi(argv[1]) : 8;
+  int writers = argc > 2 ? atoi(argv[2]) : 2;
+  double seconds = argc > 3 ? atof(argv[3]) : 1.0;
+  bool reclaimer = argc > 4 && atoi(argv[4]);
+  int err;
+
+  if (max_readers < 1 || max_readers > MAX_THREADS || writers < 0 ||
+      writers > MAX_THREADS || seconds <= 0) {
+    fprintf(stderr, "Usage: %s [max readers] [writers] [seconds] [reclaimer]\n",
+            argv[0]);
+    return 1;
+  }
+
+  if (reclaimer) {
+    err = epoch_reclaimer_start();
+    syserr(err, "list_bench: epoch_reclaimer_start");
+  }
+
+  tree = tree_new();
+
+  if (!tree) {
+    fprintf(stderr, "list_bench: out of memory\n");
+    return 1;
+  }
+
+  tree_create(tree, "/r/");
+  tree_create(tree, "/r/a/");
+  tree_create(tree, "/r/b/");
+  tree_create(tree, "/r/a/x/");
+  tree_create(tree, "/w/");
+
+  for (int readers = 1; readers <= max_readers; readers *= 2)
+    run(readers, writers, seconds);
+
+  tree_free(tree);
+  epoch_reclaimer_stop();
+  return 0;
+}
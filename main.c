@@ -1,9 +1,13 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "Tree.h"
 #include "path_utils.h"
@@ -328,6 +332,740 @@ void dumb_fucking_edgecase()
   tree_free(tr);
 }
 
+/* whether `name` is one of the comma separated names of `list` */
+static bool listed(const char* list, const char* name)
+{
+  size_t len = strlen(name);
+  const char* p = list;
+
+  while (p && *p) {
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+      return true;
+
+    p = strchr(p, ',');
+    p = p ? p + 1 : NULL;
+  }
+
+  return false;
+}
+
+static atomic_bool snapshots_done;
+
+void* snapshot_mover(void* tree)
+{
+  while (!atomic_load(&snapshots_done)) {
+    tree_move((Tree*)tree, "/s/x/", "/t/x/");
+    tree_move((Tree*)tree, "/t/x/", "/s/x/");
+  }
+
+  return NULL;
+}
+
+void* snapshot_remover(void* tree)
+{
+  while (!atomic_load(&snapshots_done)) {
+    tree_create_parents((Tree*)tree, "/s/y/z/");
+    tree_remove_recursive((Tree*)tree, "/s/y/");
+  }
+
+  return NULL;
+}
+
+/* a snapshot sees every move whole: x is in exactly one of the parents */
+void snapshot_test()
+{
+  Tree* tree = tree_new();
+  pthread_t t[3];
+  int err;
+
+  printf("snapshot_test\n");
+
+  tree_create(tree, "/s/");
+  tree_create(tree, "/t/");
+  tree_create(tree, "/s/x/");
+  tree_create(tree, "/s/x/a/");
+  atomic_store(&snapshots_done, false);
+  pthread_create(&t[0], NULL, snapshot_mover, tree);
+  pthread_create(&t[1], NULL, snapshot_mover, tree);
+  pthread_create(&t[2], NULL, snapshot_remover, tree);
+
+  for (int i = 0; i < 100 * ITER; i++) {
+    Tree* snap = tree_snapshot(tree);
+    char* s = tree_list(snap, "/s/");
+    char* t = tree_list(snap, "/t/");
+    char* x = tree_list(snap, listed(s, "x") ? "/s/x/" : "/t/x/");
+    char* y = tree_list(snap, "/s/y/");
+
+    assert(s && t && x);
+    assert(listed(s, "x") != listed(t, "x"));
+    assert(strcmp(x, "a") == 0);
+    assert(listed(s, "y") ? y && strcmp(y, "z") == 0 : !y);
+    err = tree_create(snap, "/s/q/");
+    assert(err == EROFS);
+    err = tree_move(snap, "/s/", "/q/");
+    assert(err == EROFS);
+    free(s);
+    free(t);
+    free(x);
+    free(y);
+    tree_free(snap);
+  }
+
+  atomic_store(&snapshots_done, true);
+
+  for (int i = 0; i < 3; i++)
+    pthread_join(t[i], NULL);
+
+  tree_free(tree);
+}
+
+/* a round trip keeps every directory, a damaged file is refused */
+void save_load_test()
+{
+  Tree* tree = tree_new();
+  FILE* file = tmpfile();
+  int fd = fileno(file);
+  struct stat st;
+  ssize_t written;
+  int err;
+
+  printf("save_load_test\n");
+
+  tree_create(tree, "/a/");
+  tree_create(tree, "/a/b/");
+  tree_create(tree, "/a/c/");
+  tree_create(tree, "/a/b/e/");
+  tree_create(tree, "/d/");
+  err = tree_save(tree, fd);
+  assert(err == 0);
+
+  Tree* loaded = tree_load(fd);
+  char* before = tree_list_recursive(tree, "/");
+  char* after = tree_list_recursive(loaded, "/");
+
+  assert(loaded);
+  assert(strcmp(before, "a,a/b,a/b/e,a/c,d") == 0);
+  assert(strcmp(before, after) == 0);
+
+  /* the loaded tree is a tree like any other */
+  err = tree_move(loaded, "/a/b/", "/d/b/");
+  assert(err == 0);
+  err = tree_create(loaded, "/d/b/f/");
+  assert(err == 0);
+  free(after);
+  after = tree_list_recursive(loaded, "/");
+  assert(strcmp(after, "a,a/c,d,d/b,d/b/e,d/b/f") == 0);
+  free(before);
+  free(after);
+  tree_free(loaded);
+
+  /* a name that is not a name, the heap is at the end */
+  err = fstat(fd, &st);
+  assert(err == 0);
+  written = pwrite(fd, "A", 1, st.st_size - 1);
+  assert(written == 1);
+  errno = 0;
+  loaded = tree_load(fd);
+  assert(!loaded && errno == EINVAL);
+
+  /* cut short */
+  err = ftruncate(fd, st.st_size - 8);
+  assert(err == 0);
+  errno = 0;
+  loaded = tree_load(fd);
+  assert(!loaded && errno == EINVAL);
+
+  /* not a tree at all */
+  written = pwrite(fd, "NOTATREE", 8, 0);
+  assert(written == 8);
+  errno = 0;
+  loaded = tree_load(fd);
+  assert(!loaded && errno == EINVAL);
+
+  fclose(file);
+  tree_free(tree);
+}
+
+/* a saved tree and the log started with it give the tree back */
+void log_recover_test()
+{
+  Tree* tree = tree_new();
+  FILE* image = tmpfile();
+  FILE* log = tmpfile();
+  long recovered_count;
+  int err;
+
+  printf("log_recover_test\n");
+
+  tree_create(tree, "/a/");
+  err = tree_save(tree, fileno(image));
+  assert(err == 0);
+  err = tree_log_start(tree, fileno(log), true);
+  assert(err == 0);
+  err = tree_log_start(tree, fileno(log), true);
+  assert(err == EEXIST);
+
+  err = tree_create(tree, "/a/b/");
+  assert(err == 0);
+  err = tree_create_parents(tree, "/c/d/e/");
+  assert(err == 3);
+  err = tree_move(tree, "/a/b/", "/c/b/");
+  assert(err == 0);
+  err = tree_remove(tree, "/a/");
+  assert(err == 0);
+  err = tree_remove_recursive(tree, "/c/d/");
+  assert(err == 0);
+  /* failed changes are not logged */
+  err = tree_remove(tree, "/x/");
+  assert(err == ENOENT);
+  err = tree_create(tree, "/c/");
+  assert(err == EEXIST);
+  err = tree_log_stop(tree);
+  assert(err == 0);
+
+  Tree* recovered = tree_load(fileno(image));
+  char* expected = tree_list_recursive(tree, "/");
+
+  assert(recovered);
+  recovered_count = tree_recover(recovered, fileno(log));
+  assert(recovered_count == 5);
+
+  char* listing = tree_list_recursive(recovered, "/");
+
+  assert(strcmp(expected, "c,c/b") == 0);
+  assert(strcmp(listing, expected) == 0);
+  free(listing);
+  free(expected);
+
+  /* an old log is not appended to, its records would be taken for new ones */
+  err = tree_log_start(tree, fileno(log), true);
+  assert(err == EINVAL);
+  /* nor is anything else taken for a log */
+  recovered_count = tree_recover(recovered, fileno(image));
+  assert(recovered_count == -EINVAL);
+
+  fclose(log);
+  fclose(image);
+  tree_free(recovered);
+  tree_free(tree);
+}
+
+/* lists a path and checks what came out, NULL for no such directory */
+static void check_list(Tree* tree, const char* path, const char* expected)
+{
+  char* listing = tree_list(tree, path);
+
+  assert(expected ? listing && strcmp(listing, expected) == 0 : !listing);
+  free(listing);
+}
+
+/* deep paths are served from the cache until an ancestor moves or goes */
+void cache_test()
+{
+  Tree* tree = tree_new();
+  TreeCacheStats before;
+  TreeCacheStats after;
+  int err;
+
+  printf("cache_test\n");
+
+  err = tree_create_parents(tree, "/a/b/c/d/e/f/");
+  assert(err == 6);
+  check_list(tree, "/a/b/c/d/e/", "f");
+  tree_cache_stats(tree, &before);
+  check_list(tree, "/a/b/c/d/e/", "f");
+  err = tree_create(tree, "/a/b/c/d/e/g/");
+  assert(err == 0);
+  tree_cache_stats(tree, &after);
+  assert(after.hits == before.hits + 2 && after.misses == before.misses);
+  assert(after.invalidations == 0);
+
+  /* moving an ancestor makes the entry stale, it is counted once */
+  err = tree_move(tree, "/a/b/", "/a/x/");
+  assert(err == 0);
+  check_list(tree, "/a/b/c/d/e/", NULL);
+  check_list(tree, "/a/b/c/d/e/", NULL);
+  tree_cache_stats(tree, &after);
+  assert(after.invalidations == 1);
+  check_list(tree, "/a/x/c/d/e/", "f,g");
+  tree_cache_stats(tree, &before);
+  check_list(tree, "/a/x/c/d/e/", "f,g");
+  tree_cache_stats(tree, &after);
+  assert(after.hits == before.hits + 1);
+
+  /* a remove that fails changes nothing, the entry stays */
+  err = tree_remove(tree, "/a/x/c/");
+  assert(err == ENOTEMPTY);
+  check_list(tree, "/a/x/c/d/e/", "f,g");
+  tree_cache_stats(tree, &after);
+  assert(after.hits == before.hits + 2 && after.invalidations == 1);
+
+  /* a path made again leads to the new directories */
+  err = tree_remove_recursive(tree, "/a/x/c/");
+  assert(err == 0);
+  check_list(tree, "/a/x/c/d/e/", NULL);
+  err = tree_create(tree, "/a/x/c/d/e/h/");
+  assert(err == ENOENT);
+  err = tree_create_parents(tree, "/a/x/c/d/e/h/");
+  assert(err == 4);
+  check_list(tree, "/a/x/c/d/e/", "h");
+  tree_cache_stats(tree, &after);
+  assert(after.invalidations == 2);
+
+  /* snapshots report the counters of their tree */
+  Tree* snap = tree_snapshot(tree);
+
+  tree_cache_stats(snap, &before);
+  assert(before.hits == after.hits && before.misses == after.misses);
+  tree_free(snap);
+  tree_free(tree);
+}
+
+/* paging through a listing, including past its end and with no room */
+void list_range_test()
+{
+  Tree* tree = tree_new();
+  char buf[16];
+  int err;
+
+  printf("list_range_test\n");
+
+  tree_create(tree, "/a/");
+  tree_create(tree, "/bb/");
+  tree_create(tree, "/ccc/");
+  tree_create(tree, "/d/");
+
+  err = tree_list_range(tree, "/", NULL, 2, buf, sizeof buf);
+  assert(err == 2);
+  assert(strcmp(buf, "a,bb") == 0);
+  err = tree_list_range(tree, "/", "bb", 2, buf, sizeof buf);
+  assert(err == 2);
+  assert(strcmp(buf, "ccc,d") == 0);
+  /* the cursor need not be a name in the listing */
+  err = tree_list_range(tree, "/", "b", 10, buf, sizeof buf);
+  assert(err == 3);
+  assert(strcmp(buf, "bb,ccc,d") == 0);
+
+  /* at and past the end */
+  err = tree_list_range(tree, "/", "d", 2, buf, sizeof buf);
+  assert(err == 0);
+  assert(strcmp(buf, "") == 0);
+  err = tree_list_range(tree, "/", "zz", 2, buf, sizeof buf);
+  assert(err == 0);
+  err = tree_list_range(tree, "/a/", NULL, 2, buf, sizeof buf);
+  assert(err == 0);
+
+  /* no names asked for is not an error */
+  err = tree_list_range(tree, "/", NULL, 0, buf, sizeof buf);
+  assert(err == 0);
+  assert(strcmp(buf, "") == 0);
+
+  /* what fits is written, ERANGE only if nothing does */
+  err = tree_list_range(tree, "/", NULL, 10, buf, 5);
+  assert(err == 2);
+  assert(strcmp(buf, "a,bb") == 0);
+  err = tree_list_range(tree, "/", "bb", 10, buf, 3);
+  assert(err == -ERANGE);
+  err = tree_list_range(tree, "/", NULL, 10, buf, 0);
+  assert(err == -ERANGE);
+
+  err = tree_list_range(tree, "/x/", NULL, 2, buf, sizeof buf);
+  assert(err == -ENOENT);
+  err = tree_list_range(tree, "/A/", NULL, 2, buf, sizeof buf);
+  assert(err == -EINVAL);
+  tree_free(tree);
+}
+
+/* mkdir -p: counts what was missing, whatever existed already is fine */
+void create_parents_test()
+{
+  Tree* tree = tree_new();
+  int err;
+
+  printf("create_parents_test\n");
+
+  err = tree_create_parents(tree, "/a/b/c/");
+  assert(err == 3);
+  err = tree_create_parents(tree, "/a/b/d/e/");
+  assert(err == 2);
+  err = tree_create_parents(tree, "/a/b/");
+  assert(err == 0);
+  err = tree_create_parents(tree, "/");
+  assert(err == 0);
+  err = tree_create(tree, "/a/b/c/");
+  assert(err == EEXIST);
+  err = tree_create(tree, "/a/b/d/e/");
+  assert(err == EEXIST);
+
+  char* listing = tree_list_recursive(tree, "/");
+
+  assert(strcmp(listing, "a,a/b,a/b/c,a/b/d,a/b/d/e") == 0);
+  free(listing);
+
+  err = tree_create_parents(tree, "/a/B/");
+  assert(err == -EINVAL);
+  err = tree_create_parents(tree, "a/b/");
+  assert(err == -EINVAL);
+
+  Tree* snap = tree_snapshot(tree);
+
+  err = tree_create_parents(snap, "/x/y/");
+  assert(err == -EROFS);
+  check_list(tree, "/x/", NULL);
+  tree_free(snap);
+  tree_free(tree);
+}
+
+/* rm -r: the whole subtree goes, snapshots taken before still have it */
+void remove_recursive_test()
+{
+  Tree* tree = tree_new();
+  char path[16];
+  int err;
+
+  printf("remove_recursive_test\n");
+
+  for (char c = 'a'; c <= 'z'; ++c) {
+    sprintf(path, "/r/%c/%c/", c, c);
+    err = tree_create_parents(tree, path);
+    assert(err == (c == 'a' ? 3 : 2));
+  }
+
+  err = tree_create_parents(tree, "/s/");
+  assert(err == 1);
+
+  Tree* snap = tree_snapshot(tree);
+
+  err = tree_remove(tree, "/r/");
+  assert(err == ENOTEMPTY);
+  err = tree_remove_recursive(tree, "/r/");
+  assert(err == 0);
+  check_list(tree, "/", "s");
+  check_list(tree, "/r/a/", NULL);
+  err = tree_remove_recursive(tree, "/r/");
+  assert(err == ENOENT);
+  /* an empty one too */
+  err = tree_remove_recursive(tree, "/s/");
+  assert(err == 0);
+  check_list(tree, "/", "");
+
+  err = tree_remove_recursive(tree, "/");
+  assert(err == EBUSY);
+  err = tree_remove_recursive(tree, "/R/");
+  assert(err == EINVAL);
+  err = tree_remove_recursive(snap, "/r/");
+  assert(err == EROFS);
+
+  check_list(snap, "/r/q/", "q");
+  err = tree_create_parents(tree, "/r/a/");
+  assert(err == 2);
+  check_list(tree, "/r/", "a");
+  check_list(snap, "/r/a/", "a");
+  tree_free(snap);
+  tree_free(tree);
+}
+
+/* loading paths in bulk is like tree_create_parents for each of them */
+void bulk_load_test()
+{
+  const char* paths[] = { "/a/b/c/", "/d/", "/a/b/", "/a/b/c/", "/",
+                          "/e/f/", "/d/", "/a/g/", "/e/f/h/" };
+  size_t n = sizeof paths / sizeof paths[0];
+  const char* invalid[] = { "/a/", "/b/c/", "/b/C/", "/d/" };
+  int err;
+
+  printf("bulk_load_test\n");
+
+  for (unsigned nthreads = 0; nthreads <= n + 1; ++nthreads) {
+    Tree* tree = tree_bulk_load(paths, n, nthreads);
+
+    assert(tree);
+
+    char* listing = tree_list_recursive(tree, "/");
+
+    assert(strcmp(listing, "a,a/b,a/b/c,a/g,d,e,e/f,e/f/h") == 0);
+    free(listing);
+    err = tree_create(tree, "/a/b/c/");
+    assert(err == EEXIST);
+    err = tree_move(tree, "/a/", "/e/f/a/");
+    assert(err == 0);
+    check_list(tree, "/e/f/", "a,h");
+    tree_free(tree);
+  }
+
+  Tree* empty = tree_bulk_load(NULL, 0, 4);
+
+  assert(empty);
+  check_list(empty, "/", "");
+  tree_free(empty);
+
+  for (unsigned nthreads = 1; nthreads <= 4; ++nthreads) {
+    errno = 0;
+    Tree* refused = tree_bulk_load(invalid, 4, nthreads);
+
+    assert(!refused && errno == EINVAL);
+  }
+
+  invalid[2] = "b/c/";
+  Tree* refused = tree_bulk_load(invalid, 4, 2);
+
+  assert(!refused && errno == EINVAL);
+}
+
+/* the whole subtree in preorder, taken at one moment even while it moves */
+void list_recursive_test()
+{
+  Tree* tree = tree_new();
+  pthread_t t[2];
+  int err;
+
+  printf("list_recursive_test\n");
+
+  err = tree_create_parents(tree, "/b/y/");
+  assert(err == 2);
+  err = tree_create_parents(tree, "/a/z/");
+  assert(err == 2);
+  err = tree_create_parents(tree, "/a/c/d/");
+  assert(err == 2);
+
+  char* listing = tree_list_recursive(tree, "/");
+
+  assert(strcmp(listing, "a,a/c,a/c/d,a/z,b,b/y") == 0);
+  free(listing);
+  listing = tree_list_recursive(tree, "/a/c/");
+  assert(strcmp(listing, "d") == 0);
+  free(listing);
+  listing = tree_list_recursive(tree, "/a/c/d/");
+  assert(strcmp(listing, "") == 0);
+  free(listing);
+
+  assert(!tree_list_recursive(tree, "/x/"));
+  assert(!tree_list_recursive(tree, "/a/c/d/e/"));
+  assert(!tree_list_recursive(tree, "/a"));
+
+  Tree* snap = tree_snapshot(tree);
+
+  assert(!tree_list_recursive(snap, "/"));
+  tree_free(snap);
+  tree_remove_recursive(tree, "/a/");
+  tree_remove_recursive(tree, "/b/");
+
+  tree_create(tree, "/s/");
+  tree_create(tree, "/t/");
+  tree_create(tree, "/s/x/");
+  tree_create(tree, "/s/x/a/");
+  atomic_store(&snapshots_done, false);
+  pthread_create(&t[0], NULL, snapshot_mover, tree);
+  pthread_create(&t[1], NULL, snapshot_remover, tree);
+
+  for (int i = 0; i < 10 * ITER; i++) {
+    listing = tree_list_recursive(tree, "/");
+    assert(strcmp(listing, "s,s/x,s/x/a,t") == 0 ||
+           strcmp(listing, "s,s/y,s/y/z,t,t/x,t/x/a") == 0 ||
+           strcmp(listing, "s,t,t/x,t/x/a") == 0 ||
+           strcmp(listing, "s,s/x,s/x/a,s/y,s/y/z,t") == 0);
+    free(listing);
+  }
+
+  atomic_store(&snapshots_done, true);
+
+  for (int i = 0; i < 2; i++)
+    pthread_join(t[i], NULL);
+
+  tree_free(tree);
+}
+
+typedef struct WalkSeen {
+  Tree* seen;
+  atomic_int visits;
+  atomic_bool wrong;
+} WalkSeen;
+
+/* copies the walked directories into another tree, which works only if
+ * every one comes once and after its parent */
+static void walk_visitor(const char* path, size_t depth, void* ctx)
+{
+  WalkSeen* walk = ctx;
+  size_t slashes = 0;
+
+  for (const char* p = path; *p; ++p)
+    slashes += *p == '/';
+
+  if (slashes != depth + 1 || (depth && tree_create(walk->seen, path)))
+    atomic_store(&walk->wrong, true);
+
+  atomic_fetch_add(&walk->visits, 1);
+}
+
+/* uses the walked tree itself, where nothing can be removed or moved */
+static void walk_changer(const char* path, size_t depth, void* ctx)
+{
+  WalkSeen* walk = ctx;
+  char* listing = tree_list(walk->seen, path);
+
+  if (!listing || (depth && tree_remove(walk->seen, path) != EDEADLK) ||
+      tree_remove_recursive(walk->seen, "/a/") != EDEADLK ||
+      tree_move(walk->seen, "/a/", "/m/") != EDEADLK)
+    atomic_store(&walk->wrong, true);
+
+  free(listing);
+  atomic_fetch_add(&walk->visits, 1);
+}
+
+/* every directory under the path visited once, a parent before its children */
+void walk_test()
+{
+  Tree* tree = tree_new();
+  char path[16];
+  int err;
+
+  printf("walk_test\n");
+
+  for (char c = 'a'; c <= 'z'; ++c) {
+    sprintf(path, "/%c/%c/%c/", c, c, 'a' + (c - 'a' + 1) % 26);
+    tree_create_parents(tree, path);
+    sprintf(path, "/%c/z/", c);
+    tree_create(tree, path);
+  }
+
+  char* expected = tree_list_recursive(tree, "/");
+
+  for (unsigned nthreads = 0; nthreads <= 4; ++nthreads) {
+    WalkSeen walk = { tree_new(), 0, false };
+
+    err = tree_walk(tree, "/", walk_visitor, &walk, nthreads);
+    assert(err == 0);
+    assert(!atomic_load(&walk.wrong));
+    assert(atomic_load(&walk.visits) == 1 + 26 * 3 + 25);
+
+    char* listing = tree_list_recursive(walk.seen, "/");
+
+    assert(strcmp(listing, expected) == 0);
+    free(listing);
+    tree_free(walk.seen);
+  }
+
+  /* from below the root, depths stay those from the root */
+  WalkSeen walk = { tree_new(), 0, false };
+
+  tree_create(walk.seen, "/q/");
+  err = tree_walk(tree, "/q/q/", walk_visitor, &walk, 2);
+  assert(err == 0);
+  assert(!atomic_load(&walk.wrong) && atomic_load(&walk.visits) == 2);
+  check_list(walk.seen, "/q/q/", "r");
+  tree_free(walk.seen);
+
+  WalkSeen same = { tree, 0, false };
+  err = tree_walk(tree, "/b/", walk_changer, &same, 2);
+
+  assert(err == 0);
+  assert(!atomic_load(&same.wrong) && atomic_load(&same.visits) == 4);
+  err = tree_move(tree, "/b/z/", "/b/y/");
+  assert(err == 0);
+
+  err = tree_walk(tree, "/q/x/", walk_visitor, &walk, 2);
+  assert(err == ENOENT);
+  err = tree_walk(tree, "/Q/", walk_visitor, &walk, 2);
+  assert(err == EINVAL);
+
+  Tree* snap = tree_snapshot(tree);
+
+  err = tree_walk(snap, "/", walk_visitor, &walk, 2);
+  assert(err == ENOTSUP);
+  tree_free(snap);
+  free(expected);
+  tree_free(tree);
+}
+
+void* crossing_mover1(void* tree)
+{
+  for (int i = 0; i < 100 * ITER; i++) {
+    tree_move((Tree*)tree, "/c/a/", "/a/b/a/");
+    tree_move((Tree*)tree, "/a/b/a/", "/c/a/");
+  }
+
+  return NULL;
+}
+
+void* crossing_mover2(void* tree)
+{
+  for (int i = 0; i < 100 * ITER; i++) {
+    tree_move((Tree*)tree, "/a/", "/c/a/a/");
+    tree_move((Tree*)tree, "/c/a/a/", "/a/");
+  }
+
+  return NULL;
+}
+
+/* moves each into the other's source under different parents: one of them has
+ * to give way, and the tree never gets a cycle */
+void crossing_moves_test()
+{
+  Tree* tree = tree_new();
+  pthread_t t[2];
+
+  printf("crossing_moves_test\n");
+
+  tree_create_parents(tree, "/a/b/");
+  tree_create_parents(tree, "/c/a/");
+  pthread_create(&t[0], NULL, crossing_mover1, tree);
+  pthread_create(&t[1], NULL, crossing_mover2, tree);
+
+  for (int i = 0; i < 2; i++)
+    pthread_join(t[i], NULL);
+
+  char* listing = tree_list_recursive(tree, "/");
+
+  bool whole = strcmp(listing, "a,a/b,c,c/a") == 0 ||
+               strcmp(listing, "a,a/b,a/b/a,c") == 0 ||
+               strcmp(listing, "c,c/a,c/a/a,c/a/a/b") == 0;
+
+  assert(whole);
+  free(listing);
+  tree_free(tree);
+}
+
+/* a tree big enough to be freed by several threads, freed whole and once */
+void free_parallel_test()
+{
+  size_t n = 40 * 50;
+  const char** paths = malloc(n * sizeof(char*));
+  char* names = malloc(n * 32);
+  Tree* tree;
+  char* listing;
+  size_t count;
+
+  printf("free_parallel_test\n");
+  assert(paths && names);
+
+  for (size_t i = 0; i < n; ++i) {
+    sprintf(names + 32 * i, "/%c%c/%c%c/c/d/e/f/g/h/", 'a' + (int)(i / 50) % 26,
+            'a' + (int)(i / 50) / 26, 'a' + (int)(i % 50) % 26,
+            'a' + (int)(i % 50) / 26);
+    paths[i] = names + 32 * i;
+  }
+
+  for (unsigned nthreads = 0; nthreads <= 8; nthreads += 2) {
+    tree = tree_bulk_load(paths, n, 4);
+    assert(tree);
+
+    /* one name per directory but the root */
+    listing = tree_list_recursive(tree, "/");
+    assert(listing);
+    count = 1;
+
+    for (char* c = listing; *c; ++c)
+      count += *c == ',';
+
+    assert(count == 40 + n * 7);
+    free(listing);
+    tree_free_parallel(tree, nthreads);
+  }
+
+  free(paths);
+  free(names);
+}
+
 int main(void)
 {
   simple_tree_test();
@@ -336,6 +1074,18 @@ int main(void)
   test2();
   test_lca();
   dumb_fucking_edgecase();
+  snapshot_test();
+  save_load_test();
+  log_recover_test();
+  cache_test();
+  list_range_test();
+  create_parents_test();
+  remove_recursive_test();
+  bulk_load_test();
+  list_recursive_test();
+  walk_test();
+  crossing_moves_test();
+  free_parallel_test();
   
   return 0;
 }
@@ -0,0 +1,157 @@
+/**
+ * Path parsing speed.
+ *
+ * Usage: path_bench [path length] [rounds]
+ *
+ * Times validating and splitting deep paths of about `path length` bytes the
+ * way the tree used to (`strchr` based validation, then `split_path` for every
+ * component) against each `path_parse` implementation available here.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "path_utils.h"
+
+#define N_PATHS 64
+
+static char* paths[N_PATHS];
+
+/** `is_path_valid` as it was before `path_parse`. */
+static bool strchr_valid(const char* path)
+{
+  size_t len = strlen(path);
+  const char* name_start;
+  const char* name_end;
+
+  if (len == 0 || len > MAX_PATH_LEN)
+    return false;
+
+  if (path[0] != '/' || path[len - 1] != '/')
+    return false;
+
+  name_start = path + 1;
+
+  while (name_start < path + len) {
+    name_end = strchr(name_start, '/');
+
+    if (!name_end || name_end == name_start ||
+        name_end > name_start + MAX_DIR_NAME_LEN)
+      return false;
+
+    for (const char* p = name_start; p != name_end; ++p)
+      if (*p < 'a' || *p > 'z')
+        return false;
+
+    name_start = name_end + 1;
+  }
+
+  return true;
+}
+
+/** Validate and split a path the old way, returns the number of components. */
+static size_t old_parse(const char* path)
+{
+  char component[MAX_DIR_NAME_LEN + 1];
+  size_t depth = 0;
+
+  if (!strchr_valid(path))
+    return 0;
+
+  while ((path = split_path(path, component)))
+    ++depth;
+
+  return depth;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* name, double seconds, size_t rounds,
+                   size_t bytes, size_t check)
+{
+  printf("%-8s %8.1f ns/path %8.2f GB/s  (%zu)\n", name,
+         seconds * 1e9 / (rounds * N_PATHS), bytes * rounds / seconds * 1e-9,
+         check);
+}
+
+int main(int argc, char* argv[])
+{
+  static const char* names[] = { "scalar", "sse2", "avx2" };
+  static PathView view;
+  size_t length = argc > 1 ? strtoul(argv[1], NULL, 10) : 2048;
+  size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000;
+  unsigned seed = 1;
+  size_t bytes = 0;
+  size_t check;
+  double start;
+
+  if (length < 2 || length > MAX_PATH_LEN || rounds == 0) {
+    fprintf(stderr, "Usage: %s [path length] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  /* components of 1 to 16 letters, like real directory names */
+  for (size_t i = 0; i < N_PATHS; ++i) {
+    size_t len = 0;
+
+    paths[i] = malloc(length + 1);
+
+    if (!paths[i])
+      return 1;
+
+    paths[i][len++] = '/';
+
+    while (len + 17 < length) {
+      size_t name = 1 + rand_r(&seed) % 16;
+
+      while (name--)
+        paths[i][len++] = 'a' + rand_r(&seed) % 26;
+
+      paths[i][len++] = '/';
+    }
+
+    paths[i][len] = '\0';
+    bytes += len;
+  }
+
+  check = 0;
+  start = now();
+
+  for (size_t r = 0; r < rounds; ++r)
+    for (size_t i = 0; i < N_PATHS; ++i)
+      check += old_parse(paths[i]);
+
+  report("strchr", now() - start, rounds, bytes, check);
+
+  for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); ++k) {
+    PathParser* parse = path_parser(names[k]);
+
+    if (!parse) {
+      printf("%-8s not available\n", names[k]);
+      continue;
+    }
+
+    check = 0;
+    start = now();
+
+    for (size_t r = 0; r < rounds; ++r)
+      for (size_t i = 0; i < N_PATHS; ++i)
+        check += parse(paths[i], &view) ? view.depth : 0;
+
+    report(names[k], now() - start, rounds, bytes, check);
+  }
+
+  for (size_t i = 0; i < N_PATHS; ++i)
+    free(paths[i]);
+
+  return 0;
+}
@@ -6,37 +6,226 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#define PATH_SIMD
+#endif
+
 bool is_path_valid(const char* path)
 {
-  size_t len = strlen(path);
+  PathView view;
+
+  return path_parse(path, &view);
+}
+
+/** The byte by byte parser, used where there is nothing better. */
+static bool parse_scalar(const char* path, PathView* view)
+{
+  const char* p = path;
   const char* name_start;
-  const char* name_end;
 
-  if (len == 0 || len > MAX_PATH_LEN)
+  if (*p != '/')
     return false;
 
-  if (path[0] != '/' || path[len - 1] != '/')
+  view->path = path;
+  view->depth = 0;
+  view->start[0] = 1;
+
+  while (*++p) {
+    /* Start of current path component, just after '/'. */
+    name_start = p;
+
+    while (*p >= 'a' && *p <= 'z')
+      ++p;
+
+    if (*p != '/' || p == name_start || p > name_start + MAX_DIR_NAME_LEN ||
+        p >= path + MAX_PATH_LEN)
+      return false;
+
+    view->start[++view->depth] = p - path + 1;
+  }
+
+  return true;
+}
+
+#ifdef PATH_SIMD
+
+/*
+ * The vectorised parsers classify a whole block of characters at once into
+ * bit masks, one bit per character: separators, the terminating null and
+ * anything else that is not a lowercase letter. `scan_block` then only has to
+ * visit the separators. Blocks are loaded aligned, so a load never crosses
+ * into a page the path does not reach, though it may read a few bytes around
+ * the path, which is why the address and thread sanitizers are told to look
+ * away.
+ */
+
+#define NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize_thread))
+
+/**
+ * Feed the masks of a block whose bit 0 is the character at `pos` into the
+ * view. `*prev` is the position of the last separator seen. Returns 1 if the
+ * path turned out valid, -1 if not and 0 if the path goes on.
+ */
+static int scan_block(PathView* view, size_t* prev, size_t pos,
+                      uint64_t slash, uint64_t bad, uint64_t end)
+{
+  /* nothing after the null counts */
+  uint64_t keep = end ? (end & -end) - 1 : ~(uint64_t)0;
+  size_t at;
+
+  if (bad & keep)
+    return -1;
+
+  for (slash &= keep; slash; slash &= slash - 1) {
+    at = pos + __builtin_ctzll(slash);
+
+    /* the leading '/' is checked by the caller */
+    if (at == 0)
+      continue;
+
+    if (at == *prev + 1 || at > *prev + 1 + MAX_DIR_NAME_LEN ||
+        at >= MAX_PATH_LEN)
+      return -1;
+
+    view->start[++view->depth] = at + 1;
+    *prev = at;
+  }
+
+  if (!end)
+    return 0;
+
+  /* the path has to end with '/' */
+  return pos + __builtin_ctzll(end) == *prev + 1 ? 1 : -1;
+}
+
+NO_SANITIZE
+static bool parse_sse2(const char* path, PathView* view)
+{
+  size_t skip = (uintptr_t)path & 15;
+  const __m128i* block = (const __m128i*)(path - skip);
+  const __m128i slash_v = _mm_set1_epi8('/');
+  const __m128i zero_v = _mm_setzero_si128();
+  const __m128i a_v = _mm_set1_epi8('a');
+  const __m128i z_v = _mm_set1_epi8('z');
+  uint64_t slash;
+  uint64_t end;
+  uint64_t bad;
+  size_t pos = 0;
+  size_t prev = 0;
+  int state;
+
+  if (*path != '/')
     return false;
 
-  /* Start of current path component, just after '/'. */
-  name_start = path + 1;
+  view->path = path;
+  view->depth = 0;
+  view->start[0] = 1;
+
+  for (;; ++block) {
+    __m128i v = _mm_load_si128(block);
+
+    slash = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, slash_v));
+    end = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero_v));
+    /* signed comparisons, so anything above 127 is below 'a' */
+    bad = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, a_v),
+                                                   _mm_cmpgt_epi8(v, z_v)));
+    bad &= ~slash & ~end;
+    state = scan_block(view, &prev, pos, slash >> skip, bad >> skip,
+                       end >> skip);
+
+    if (state)
+      return state > 0;
 
-  while (name_start < path + len) {
-    /* End of current path component, at '/'. */
-    name_end = strchr(name_start, '/');
+    pos += 16 - skip;
+    skip = 0;
 
-    if (!name_end || name_end == name_start ||
-        name_end > name_start + MAX_DIR_NAME_LEN)
+    if (pos > MAX_PATH_LEN)
       return false;
+  }
+}
+
+NO_SANITIZE __attribute__((target("avx2")))
+static bool parse_avx2(const char* path, PathView* view)
+{
+  size_t skip = (uintptr_t)path & 31;
+  const __m256i* block = (const __m256i*)(path - skip);
+  const __m256i slash_v = _mm256_set1_epi8('/');
+  const __m256i zero_v = _mm256_setzero_si256();
+  const __m256i a_v = _mm256_set1_epi8('a' - 1);
+  const __m256i z_v = _mm256_set1_epi8('z');
+  uint64_t slash;
+  uint64_t end;
+  uint64_t bad;
+  size_t pos = 0;
+  size_t prev = 0;
+  int state;
+
+  if (*path != '/')
+    return false;
+
+  view->path = path;
+  view->depth = 0;
+  view->start[0] = 1;
+
+  for (;; ++block) {
+    __m256i v = _mm256_load_si256(block);
+
+    slash = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, slash_v));
+    end = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero_v));
+    /* there is no signed "less than" here, v <= 'a' - 1 is not v > 'a' - 1 */
+    bad = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, a_v)) |
+          (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, z_v));
+    bad &= ~slash & ~end & 0xffffffffu;
+    state = scan_block(view, &prev, pos, slash >> skip, bad >> skip,
+                       end >> skip);
 
-    for (const char* p = name_start; p != name_end; ++p)
-      if (*p < 'a' || *p > 'z')
-        return false;
+    if (state)
+      return state > 0;
 
-    name_start = name_end + 1;
+    pos += 32 - skip;
+    skip = 0;
+
+    if (pos > MAX_PATH_LEN)
+      return false;
   }
+}
 
-  return true;
+#endif  /* PATH_SIMD */
+
+PathParser* path_parser(const char* name)
+{
+  if (strcmp(name, "scalar") == 0)
+    return parse_scalar;
+#ifdef PATH_SIMD
+  if (strcmp(name, "sse2") == 0)
+    return parse_sse2;
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    return parse_avx2;
+#endif
+  return NULL;
+}
+
+bool path_parse(const char* path, PathView* view)
+{
+  /* chosen on first use, every thread comes to the same choice */
+  static PathParser* parser;
+  PathParser* parse = __atomic_load_n(&parser, __ATOMIC_RELAXED);
+
+  if (!parse) {
+    if (!(parse = path_parser("avx2")) && !(parse = path_parser("sse2")))
+      parse = path_parser("scalar");
+
+    __atomic_store_n(&parser, parse, __ATOMIC_RELAXED);
+  }
+
+  return parse(path, view);
+}
+
+const char* path_component(const PathView* view, size_t i, size_t* len)
+{
+  *len = view->start[i + 1] - view->start[i] - 1;
+  return view->path + view->start[i];
 }
 
 const char* split_path(const char* path, char* component)
@@ -116,15 +305,17 @@ const char** make_map_contents_array(HashMap* map)
   void* value = NULL;
 
   if (!result)
-    exit(1);
+    return NULL;
 
-  while (hmap_next(map, &it, key, &value)) {
+  /* The map may be read concurrently with a writer (see HashMap.h), so do not
+   * trust it to yield exactly `n_keys` keys. */
+  while (key < result + n_keys && hmap_next(map, &it, key, &value)) {
     key++;
   }
 
   // Set last array element to NULL.
   *key = NULL;
-  qsort(result, n_keys, sizeof(char*), compare_string_pointers);
+  qsort(result, key - result, sizeof(char*), compare_string_pointers);
   return result;
 }
 
@@ -137,6 +328,9 @@ char* make_map_contents_string(HashMap* map)
   // Including ending null character.
   size_t result_size = 0;
 
+  if (!keys)
+    exit(1);
+
   for (const char** key = keys; *key; ++key)
     result_size += strlen(*key) + 1;
 
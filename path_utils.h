@@ -3,6 +3,8 @@
 #define _PATH_UTILS_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "HashMap.h"
 
@@ -20,6 +22,44 @@
  * MAX_DIR_NAME_LEN. */
 bool is_path_valid(const char* path);
 
+/**
+ * A path parsed into its components, which stay in the original string. Lets
+ * operations walk a path and look its parts up without copying any of them.
+ */
+typedef struct PathView {
+  const char* path;
+  /** Number of components, 0 for "/". */
+  size_t depth;
+  /**
+   * Component `i` starts at `start[i]` and ends right before the '/' at
+   * `start[i + 1] - 1`. `start[i]` is also the length of the path to the
+   * `i`-th ancestor, eg. `start[depth - 1]` for the parent.
+   */
+  uint16_t start[MAX_PATH_LEN / 2 + 1];
+} PathView;
+
+/**
+ * Validate a path like `is_path_valid` and if it is valid parse it into `view`
+ * in the same pass. The view borrows `path`. Returns whether it is valid.
+ *
+ * On x86-64 the path is scanned with SSE2 or AVX2, whichever the CPU supports,
+ * a block of characters at a time. */
+bool path_parse(const char* path, PathView* view);
+
+/** An implementation of `path_parse`. */
+typedef bool PathParser(const char* path, PathView* view);
+
+/**
+ * Return the implementation of `path_parse` called `name` ("scalar", "sse2"
+ * or "avx2"), or NULL if it is not available here. For benchmarks and tests.
+ */
+PathParser* path_parser(const char* name);
+
+/**
+ * Return the `i`-th component of a parsed path (not null-terminated, it points
+ * into the path), its length is saved under `len`. */
+const char* path_component(const PathView* view, size_t i, size_t* len);
+
 /**
  * Return the subpath obtained by removing the first component.
  * Args:
@@ -54,7 +94,7 @@ char* make_path_to_parent(const char* path, char* component);
  * Return an array containing all keys, lexicographically sorted.
  * The result is null-terminated.
  * Keys are not copied, they are only valid as long as the map.
- * The caller should free the result. */
+ * The caller should free the result. NULL if out of memory. */
 const char** make_map_contents_array(HashMap* map);
 
 /**
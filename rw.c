@@ -1,6 +1,9 @@
 
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
 
 #include "err.h"
 #include "rw.h"
@@ -68,6 +71,31 @@ int writer_entry(Monitor* mon)
   return 0;
 }
 
+int writer_tryentry(Monitor* mon)
+{
+  bool busy;
+  int err = 0;
+
+  if (!mon)
+    return 0;
+
+  err = pthread_mutex_lock(&mon->mutex);
+
+  if (err)
+    return err;
+
+  busy = mon->rwait > 0 || mon->rcount > 0 || mon->wcount > 0 ||
+         mon->wwait > 0;
+
+  if (!busy)
+    ++mon->wcount;
+
+  err = pthread_mutex_unlock(&mon->mutex);
+  syserr(err, "writer_tryentry, mutex unlock");
+
+  return busy ? EBUSY : 0;
+}
+
 int writer_exit(Monitor* mon)
 {
   int err = 0;
@@ -133,6 +161,30 @@ int reader_entry(Monitor* mon)
   return 0;
 }
 
+int reader_tryentry(Monitor* mon)
+{
+  bool busy;
+  int err = 0;
+
+  if (!mon)
+    return 0;
+
+  err = pthread_mutex_lock(&mon->mutex);
+
+  if (err)
+    return err;
+
+  busy = mon->wwait > 0 || mon->wcount > 0;
+
+  if (!busy)
+    ++mon->rcount;
+
+  err = pthread_mutex_unlock(&mon->mutex);
+  syserr(err, "reader_tryentry, mutex unlock");
+
+  return busy ? EBUSY : 0;
+}
+
 int reader_exit(Monitor* mon)
 {
   int err = 0;
@@ -168,3 +220,25 @@ int reader_exit(Monitor* mon)
 
   return 0;
 }
+
+void pins_init(Pins* pins)
+{
+  atomic_init(pins, 0);
+}
+
+void pin(Pins* pins)
+{
+  atomic_fetch_add(pins, 1);
+}
+
+void unpin(Pins* pins)
+{
+  atomic_fetch_sub(pins, 1);
+}
+
+void pins_drain(Pins* pins)
+{
+  /* without futexes there is nothing better to do than to yield */
+  while (atomic_load(pins) != 0)
+    sched_yield();
+}
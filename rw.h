@@ -8,6 +8,14 @@
  *
  * Works in the classic way apart from from dealing with potential spurious
  * wakeups and possible starvation by storing additional info.
+ *
+ * There are two implementations behind the same interface. `rw.c` uses a
+ * pthread mutex and two condition variables. `rw_futex.c` (chosen by defining
+ * RW_FUTEX) takes 16 bytes instead of the mutex version's 184 (glibc,
+ * x86-64) and lets uncontended readers in and out with a single atomic
+ * instruction each. Both make new readers wait for writers that are waiting
+ * and let the readers held back by a writer in right after it, so neither
+ * side starves.
  */
 
 #ifndef _RW_H_
@@ -16,6 +24,32 @@
 #include <stddef.h>
 #include <pthread.h>
 
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef RW_FUTEX
+
+/**
+ * A compact phase-fair r&w lock built on atomics and futex(2), see
+ * `rw_futex.c`. Readers are counted in units of 0x100 in `rin` and `rout`, the
+ * low bits of `rin` tell the readers whether a writer is present. Writers
+ * queue up on the `win`/`wout` ticket pair.
+ *
+ * It is four words and not one because futex(2) only sleeps on a 32 bit word
+ * and each kind of waiter needs its own: readers held back by a writer sleep
+ * on `rin`, the present writer waiting for readers to leave on `rout` and the
+ * queued writers on `wout`. Sharing a word would wake all of them on every
+ * change, and a single word leaves too few bits for the reader counts.
+ */
+typedef struct Monitor {
+  _Atomic uint32_t rin;
+  _Atomic uint32_t rout;
+  _Atomic uint32_t win;
+  _Atomic uint32_t wout;
+} Monitor;
+
+#else
+
 /** Using this structure to represent a r&w lock, using mutices and conds. */
 typedef struct Monitor {
   pthread_mutex_t mutex;
@@ -30,6 +64,8 @@ typedef struct Monitor {
   size_t rwoken;
 } Monitor;
 
+#endif  /* RW_FUTEX */
+
 /* All functions return an error code that is 0 in case of success or some errno
  * value otherwise. If an error permanently damaging the mechanism occured then
  * the process terminates completely. */
@@ -43,6 +79,13 @@ int monit_destroy(Monitor* mon);
 /** Lock the monitor as a writer. Now no-one will be granted acess to it. */
 int writer_entry(Monitor* mon);
 
+/**
+ * Like `writer_entry` but returns EBUSY rather than wait behind another writer.
+ * Whether it waits for the readers already inside to leave or fails as well is
+ * up to the implementation.
+ */
+int writer_tryentry(Monitor* mon);
+
 /**
  * Exit the monitor as a writer. This function should be called only if
  * the monitor got previously acquired via `writer_entry` by the same thread.
@@ -52,7 +95,35 @@ int writer_exit(Monitor* mon);
 /** Weak lock on the monitor, get reader privileges. */
 int reader_entry(Monitor* mon);
 
+/**
+ * Like `reader_entry` but returns EBUSY rather than wait for a writer, one
+ * that is inside or waiting to get in.
+ */
+int reader_tryentry(Monitor* mon);
+
 /** Unlock the monitor as a reader. */
 int reader_exit(Monitor* mon);
 
+/**
+ * A count of the users of an object which can be waited on to drop to zero,
+ * eg. before the object is destroyed. Does not lock anything by itself.
+ */
+typedef _Atomic uint32_t Pins;
+
+/** Initialise a pin counter to zero. */
+void pins_init(Pins* pins);
+
+/** Register a user. */
+void pin(Pins* pins);
+
+/** Unregister a user. The object may be gone right after this returns. */
+void unpin(Pins* pins);
+
+/**
+ * Wait until there are no users. The caller must make sure that new users
+ * coming meanwhile notice and unpin without doing anything (see `pin_child` in
+ * Tree.c), and that only one thread drains a counter at a time.
+ */
+void pins_drain(Pins* pins);
+
 #endif  /* _RW_H_ */
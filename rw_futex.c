@@ -0,0 +1,221 @@
+/**
+ * The futex based implementation of the `rw.h` interface.
+ *
+ * This is the phase-fair ticket lock (PF-T) of Brandenburg and Anderson with
+ * futex(2) waits instead of busy waiting:
+ *
+ *   - a reader registers in `rin`. If no writer is present it is in. Otherwise
+ *     it waits for the writer phase it saw to end, and only that one;
+ *   - a writer takes a ticket from `win` and waits for its turn on `wout`.
+ *     Then it marks itself present in `rin`, which stops new readers, and
+ *     waits for the readers that came before it to leave through `rout`;
+ *   - a leaving writer clears its mark, letting in every reader it held back,
+ *     and passes the turn on to the next writer.
+ *
+ * Writers therefore go in ticket order and readers never wait for more than
+ * one writer.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "rw.h"
+
+/** One reader in `rin` and `rout`. */
+#define RINC 0x100u
+/** A writer is present in `rin`. */
+#define PRES 0x2u
+/** The phase of the present writer, parity of its ticket. */
+#define PHID 0x1u
+#define WBITS (PRES | PHID)
+
+/** Someone waits in `pins_drain`. */
+#define DRAINING 0x80000000u
+
+/* Waiting may return early because of a signal or a change of `*addr`, all
+ * callers recheck their condition in a loop. */
+static void futex_wait(_Atomic uint32_t* addr, uint32_t val)
+{
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t* addr, int count)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+int monit_init(Monitor* mon)
+{
+  atomic_init(&mon->rin, 0);
+  atomic_init(&mon->rout, 0);
+  atomic_init(&mon->win, 0);
+  atomic_init(&mon->wout, 0);
+
+  return 0;
+}
+
+int monit_destroy(Monitor* mon)
+{
+  (void)mon;
+  return 0;
+}
+
+/** Shut the readers out and wait for those already in, it is our turn. */
+static void writer_shut_readers(Monitor* mon, uint32_t ticket)
+{
+  uint32_t rticket;
+  uint32_t val;
+
+  rticket = atomic_fetch_add(&mon->rin, PRES | (ticket & PHID)) & ~WBITS;
+
+  while ((val = atomic_load(&mon->rout)) != rticket)
+    futex_wait(&mon->rout, val);
+}
+
+int writer_entry(Monitor* mon)
+{
+  uint32_t ticket;
+  uint32_t val;
+
+  if (!mon)
+    return 0;
+
+  /* wait for our turn among the writers */
+  ticket = atomic_fetch_add(&mon->win, 1);
+
+  while ((val = atomic_load(&mon->wout)) != ticket)
+    futex_wait(&mon->wout, val);
+
+  writer_shut_readers(mon, ticket);
+  return 0;
+}
+
+int writer_tryentry(Monitor* mon)
+{
+  uint32_t ticket;
+
+  if (!mon)
+    return 0;
+
+  /* take a ticket only if it is our turn right away */
+  ticket = atomic_load(&mon->wout);
+
+  if (!atomic_compare_exchange_strong(&mon->win, &ticket, ticket + 1))
+    return EBUSY;
+
+  writer_shut_readers(mon, ticket);
+  return 0;
+}
+
+int writer_exit(Monitor* mon)
+{
+  uint32_t rin;
+  uint32_t wout;
+
+  if (!mon)
+    return 0;
+
+  /* readers have arrived since we marked ourselves if `rin` moved on */
+  rin = atomic_fetch_and(&mon->rin, ~WBITS) & ~WBITS;
+
+  if (rin != atomic_load(&mon->rout))
+    futex_wake(&mon->rin, INT_MAX);
+
+  wout = atomic_fetch_add(&mon->wout, 1) + 1;
+
+  if (atomic_load(&mon->win) != wout)
+    futex_wake(&mon->wout, INT_MAX);
+
+  return 0;
+}
+
+int reader_entry(Monitor* mon)
+{
+  uint32_t phase;
+  uint32_t val;
+
+  if (!mon)
+    return 0;
+
+  phase = atomic_fetch_add(&mon->rin, RINC) & WBITS;
+
+  /* wait until the writer we ran into is gone, a next one will let us in */
+  if (phase)
+    while (((val = atomic_load(&mon->rin)) & WBITS) == phase)
+      futex_wait(&mon->rin, val);
+
+  return 0;
+}
+
+int reader_tryentry(Monitor* mon)
+{
+  uint32_t rin;
+
+  if (!mon)
+    return 0;
+
+  /* a writer waiting for its turn would shut us out soon anyway */
+  if (atomic_load(&mon->win) != atomic_load(&mon->wout))
+    return EBUSY;
+
+  /* Register only while no writer is present. Backing out through `rout`
+   * instead could let a writer in that counted on the readers before us
+   * leaving, not on us. A writer marking itself meanwhile fails the exchange
+   * and we give up without having been counted. */
+  rin = atomic_load(&mon->rin);
+
+  do {
+    if (rin & WBITS)
+      return EBUSY;
+  } while (!atomic_compare_exchange_weak(&mon->rin, &rin, rin + RINC));
+
+  return 0;
+}
+
+int reader_exit(Monitor* mon)
+{
+  if (!mon)
+    return 0;
+
+  atomic_fetch_add(&mon->rout, RINC);
+
+  /* a present writer may be waiting for us to be the last one out */
+  if (atomic_load(&mon->rin) & PRES)
+    futex_wake(&mon->rout, 1);
+
+  return 0;
+}
+
+void pins_init(Pins* pins)
+{
+  atomic_init(pins, 0);
+}
+
+void pin(Pins* pins)
+{
+  atomic_fetch_add(pins, 1);
+}
+
+void unpin(Pins* pins)
+{
+  uint32_t old = atomic_fetch_sub(pins, 1);
+
+  if (old == (DRAINING | 1))
+    futex_wake(pins, 1);
+}
+
+void pins_drain(Pins* pins)
+{
+  uint32_t val = atomic_fetch_or(pins, DRAINING) | DRAINING;
+
+  while (val != DRAINING) {
+    futex_wait(pins, val);
+    val = atomic_load(pins);
+  }
+
+  /* whoever pinned us meanwhile is about to back off, do not lose them */
+  atomic_fetch_and(pins, ~DRAINING);
+}
@@ -0,0 +1,146 @@
+/**
+ * Reader and writer exclusion of a `Monitor`.
+ *
+ * Usage: rw_test [rounds]
+ *
+ * Readers and writers enter and leave one monitor, half of the time with the
+ * `tryentry` variants, and check on the way in that nobody is inside who must
+ * not be: no writer next to a reader and no one at all next to a writer. Built
+ * once for each implementation of `rw.h`, as `rw_test` and `rw_futex_test`.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "err.h"
+#include "rw.h"
+
+#define N_READERS 4
+#define N_WRITERS 2
+
+static Monitor mon;
+static atomic_int readers_inside;
+static atomic_int writers_inside;
+static atomic_ulong violations;
+static atomic_ulong busy;
+static unsigned long rounds = 20000;
+
+/** Stay inside for a while every so often, so that others pile up. */
+static void linger(unsigned long round)
+{
+  if (round % 8 == 0)
+    sched_yield();
+}
+
+static void* reader(void* arg)
+{
+  int err;
+
+  (void)arg;
+
+  for (unsigned long i = 0; i < rounds; ++i) {
+    err = i % 2 ? reader_tryentry(&mon) : reader_entry(&mon);
+
+    if (err == EBUSY) {
+      atomic_fetch_add(&busy, 1);
+      continue;
+    }
+
+    syserr(err, "rw_test: Failed to enter as a reader");
+    atomic_fetch_add(&readers_inside, 1);
+
+    if (atomic_load(&writers_inside) != 0)
+      atomic_fetch_add(&violations, 1);
+
+    linger(i);
+    atomic_fetch_sub(&readers_inside, 1);
+    err = reader_exit(&mon);
+    syserr(err, "rw_test: Failed to exit as a reader");
+  }
+
+  return NULL;
+}
+
+static void* writer(void* arg)
+{
+  int err;
+
+  (void)arg;
+
+  for (unsigned long i = 0; i < rounds; ++i) {
+    err = i % 2 ? writer_tryentry(&mon) : writer_entry(&mon);
+
+    if (err == EBUSY) {
+      atomic_fetch_add(&busy, 1);
+      continue;
+    }
+
+    syserr(err, "rw_test: Failed to enter as a writer");
+
+    if (atomic_fetch_add(&writers_inside, 1) != 0 ||
+        atomic_load(&readers_inside) != 0)
+      atomic_fetch_add(&violations, 1);
+
+    linger(i);
+    atomic_fetch_sub(&writers_inside, 1);
+    err = writer_exit(&mon);
+    syserr(err, "rw_test: Failed to exit as a writer");
+  }
+
+  return NULL;
+}
+
+/** What the `tryentry` variants must do without anybody else around. */
+static int check_alone(void)
+{
+  int failed = 0;
+
+  failed += reader_tryentry(&mon) != 0;
+  failed += reader_exit(&mon) != 0;
+
+  failed += writer_tryentry(&mon) != 0;
+  failed += reader_tryentry(&mon) != EBUSY;
+  failed += writer_tryentry(&mon) != EBUSY;
+  failed += writer_exit(&mon) != 0;
+
+  return failed;
+}
+
+int main(int argc, char** argv)
+{
+  pthread_t threads[N_READERS + N_WRITERS];
+  int err;
+
+  if (argc > 1)
+    rounds = strtoul(argv[1], NULL, 10);
+
+  err = monit_init(&mon);
+  syserr(err, "rw_test: Failed to initialise a monitor");
+
+  if (check_alone()) {
+    printf("rw_test: tryentry is wrong without contention\n");
+    return 1;
+  }
+
+  for (int i = 0; i < N_READERS + N_WRITERS; ++i) {
+    err = pthread_create(&threads[i], NULL, i < N_READERS ? reader : writer,
+                         NULL);
+    syserr(err, "rw_test: Failed to create a thread");
+  }
+
+  for (int i = 0; i < N_READERS + N_WRITERS; ++i) {
+    err = pthread_join(threads[i], NULL);
+    syserr(err, "rw_test: Failed to join a thread");
+  }
+
+  err = monit_destroy(&mon);
+  syserr(err, "rw_test: Failed to destroy a monitor");
+
+  printf("rounds=%lu busy=%lu violations=%lu\n", rounds,
+         atomic_load(&busy), atomic_load(&violations));
+  return atomic_load(&violations) != 0;
+}
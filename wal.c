@@ -0,0 +1,381 @@
+#include <pthread.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "err.h"
+#include "wal.h"
+
+/** What the file starts with, terminator included. */
+#define WAL_MAGIC "DIRLOG1"
+
+/** What precedes every record in the file. */
+typedef struct Frame {
+  uint32_t len;
+  /* CRC-32 of the record */
+  uint32_t crc;
+} Frame;
+
+struct Wal {
+  int fd;
+  pthread_t committer;
+  pthread_mutex_t lock;
+  /* signalled for the committer when it sleeps and there is work */
+  pthread_cond_t work;
+  /* broadcast each time a batch is on disk */
+  pthread_cond_t done;
+  /* The batch being filled and the one being written. Everything below is
+   * under the lock. */
+  char* batch;
+  size_t len;
+  size_t size;
+  char* spare;
+  size_t spare_size;
+  /* bytes appended since the log was opened, and how many of them are on
+   * disk */
+  uint64_t appended;
+  uint64_t durable;
+  bool idle;
+  bool stop;
+  /* first failure of a write, a sync or an append, nothing is written after
+   * it so that the file stays a prefix of what was appended */
+  int err;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+  uint32_t c;
+
+  for (uint32_t i = 0; i < 256; ++i) {
+    c = i;
+
+    for (int k = 0; k < 8; ++k)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+
+    crc_table[i] = c;
+  }
+}
+
+/** The CRC-32 of `len` bytes, like zlib's. */
+static uint32_t crc32(const void* data, size_t len)
+{
+  const unsigned char* p = data;
+  uint32_t c = 0xFFFFFFFFu;
+
+  pthread_once(&crc_once, crc_init);
+
+  while (len--)
+    c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+
+  return c ^ 0xFFFFFFFFu;
+}
+
+int write_all(int fd, const void* data, size_t len)
+{
+  const char* p = data;
+  ssize_t written;
+
+  while (len) {
+    written = write(fd, p, len);
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return errno;
+    }
+
+    p += written;
+    len -= written;
+  }
+
+  return 0;
+}
+
+/** The commit thread: take the batch, write and sync it, repeat. */
+static void* committer_main(void* arg)
+{
+  Wal* wal = arg;
+  char* batch;
+  size_t len;
+  size_t size;
+  uint64_t end;
+  int result;
+  int err;
+
+  err = pthread_mutex_lock(&wal->lock);
+  syserr(err, "wal committer, mutex lock");
+
+  for (;;) {
+    while (!wal->len && !wal->stop) {
+      wal->idle = true;
+      err = pthread_cond_wait(&wal->work, &wal->lock);
+      syserr(err, "wal committer, cond wait");
+    }
+
+    wal->idle = false;
+
+    if (!wal->len)
+      break;
+
+    /* appends go on into the other buffer meanwhile */
+    batch = wal->batch;
+    size = wal->size;
+    len = wal->len;
+    end = wal->appended;
+    wal->batch = wal->spare;
+    wal->size = wal->spare_size;
+    wal->spare = batch;
+    wal->spare_size = size;
+    wal->len = 0;
+    result = wal->err;
+
+    err = pthread_mutex_unlock(&wal->lock);
+    syserr(err, "wal committer, mutex unlock");
+
+    if (!result)
+      result = write_all(wal->fd, batch, len);
+
+    if (!result && fdatasync(wal->fd))
+      result = errno;
+
+    err = pthread_mutex_lock(&wal->lock);
+    syserr(err, "wal committer, mutex lock");
+
+    if (result && !wal->err)
+      wal->err = result;
+
+    wal->durable = end;
+    err = pthread_cond_broadcast(&wal->done);
+    syserr(err, "wal committer, cond broadcast");
+  }
+
+  err = pthread_mutex_unlock(&wal->lock);
+  syserr(err, "wal committer, mutex unlock");
+  return NULL;
+}
+
+/** Write the header to an empty file, returns 0 or an errno. */
+static int write_header(int fd)
+{
+  struct stat st;
+
+  if (fstat(fd, &st))
+    return errno;
+
+  /* records of an earlier log would pass for ours */
+  if (st.st_size != 0)
+    return EINVAL;
+
+  if (lseek(fd, 0, SEEK_SET) < 0)
+    return errno;
+
+  return write_all(fd, WAL_MAGIC, sizeof(WAL_MAGIC));
+}
+
+Wal* wal_open(int fd)
+{
+  Wal* wal = calloc(1, sizeof(Wal));
+  int err;
+
+  if (!wal) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  wal->fd = fd;
+
+  if ((err = pthread_mutex_init(&wal->lock, NULL))) {
+    free(wal);
+    errno = err;
+    return NULL;
+  }
+
+  if ((err = pthread_cond_init(&wal->work, NULL))) {
+    pthread_mutex_destroy(&wal->lock);
+    free(wal);
+    errno = err;
+    return NULL;
+  }
+
+  if ((err = pthread_cond_init(&wal->done, NULL))) {
+    pthread_cond_destroy(&wal->work);
+    pthread_mutex_destroy(&wal->lock);
+    free(wal);
+    errno = err;
+    return NULL;
+  }
+
+  /* the header goes last but one, nothing can fail after it but the thread */
+  if ((err = write_header(fd)) ||
+      (err = pthread_create(&wal->committer, NULL, committer_main, wal))) {
+    pthread_cond_destroy(&wal->done);
+    pthread_cond_destroy(&wal->work);
+    pthread_mutex_destroy(&wal->lock);
+    free(wal);
+    errno = err;
+    return NULL;
+  }
+
+  return wal;
+}
+
+uint64_t wal_append(Wal* wal, const void* rec, size_t len)
+{
+  Frame frame = { len, crc32(rec, len) };
+  uint64_t pos;
+  size_t size;
+  char* batch;
+  int err;
+
+  err = pthread_mutex_lock(&wal->lock);
+  syserr(err, "wal append, mutex lock");
+
+  if (!wal->err && wal->len + sizeof(Frame) + len > wal->size) {
+    size = wal->size ? 2 * wal->size : 64 * 1024;
+
+    while (wal->len + sizeof(Frame) + len > size)
+      size *= 2;
+
+    batch = realloc(wal->batch, size);
+
+    if (batch) {
+      wal->batch = batch;
+      wal->size = size;
+    } else {
+      wal->err = ENOMEM;
+    }
+  }
+
+  /* a failed log takes nothing more, waiting for this returns the error */
+  if (wal->err) {
+    pos = wal->appended;
+    err = pthread_mutex_unlock(&wal->lock);
+    syserr(err, "wal append, mutex unlock");
+    return pos;
+  }
+
+  memcpy(wal->batch + wal->len, &frame, sizeof(Frame));
+  memcpy(wal->batch + wal->len + sizeof(Frame), rec, len);
+  wal->len += sizeof(Frame) + len;
+  wal->appended += sizeof(Frame) + len;
+  pos = wal->appended;
+
+  if (wal->idle) {
+    wal->idle = false;
+    err = pthread_cond_signal(&wal->work);
+    syserr(err, "wal append, cond signal");
+  }
+
+  err = pthread_mutex_unlock(&wal->lock);
+  syserr(err, "wal append, mutex unlock");
+  return pos;
+}
+
+int wal_wait(Wal* wal, uint64_t pos)
+{
+  int result;
+  int err;
+
+  err = pthread_mutex_lock(&wal->lock);
+  syserr(err, "wal wait, mutex lock");
+
+  while (wal->durable < pos) {
+    err = pthread_cond_wait(&wal->done, &wal->lock);
+    syserr(err, "wal wait, cond wait");
+  }
+
+  result = wal->err;
+  err = pthread_mutex_unlock(&wal->lock);
+  syserr(err, "wal wait, mutex unlock");
+  return result;
+}
+
+int wal_close(Wal* wal)
+{
+  int result;
+  int err;
+
+  err = pthread_mutex_lock(&wal->lock);
+  syserr(err, "wal close, mutex lock");
+  wal->stop = true;
+  err = pthread_cond_signal(&wal->work);
+  syserr(err, "wal close, cond signal");
+  err = pthread_mutex_unlock(&wal->lock);
+  syserr(err, "wal close, mutex unlock");
+
+  /* it commits what is left on its way out */
+  err = pthread_join(wal->committer, NULL);
+  syserr(err, "wal close, join");
+
+  result = wal->err;
+  pthread_cond_destroy(&wal->done);
+  pthread_cond_destroy(&wal->work);
+  pthread_mutex_destroy(&wal->lock);
+  free(wal->batch);
+  free(wal->spare);
+  free(wal);
+  return result;
+}
+
+long wal_replay(int fd, int fn(const void* rec, size_t len, void* arg),
+                void* arg)
+{
+  struct stat st;
+  const char* map;
+  size_t pos;
+  Frame frame;
+  long count = 0;
+  int err;
+
+  if (fstat(fd, &st))
+    return -errno;
+
+  /* the header is written before anything else, a crash may cut it short */
+  if ((size_t)st.st_size < sizeof(WAL_MAGIC))
+    return 0;
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (map == MAP_FAILED)
+    return -errno;
+
+  if (memcmp(map, WAL_MAGIC, sizeof(WAL_MAGIC)) != 0) {
+    munmap((void*)map, st.st_size);
+    return -EINVAL;
+  }
+
+  pos = sizeof(WAL_MAGIC);
+  madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+  /* A crash may leave the last batch written in part, or the file longer
+   * with zeros at the end. Records are never empty. */
+  while (st.st_size - pos >= sizeof(Frame)) {
+    memcpy(&frame, map + pos, sizeof(Frame));
+    pos += sizeof(Frame);
+
+    if (frame.len == 0 || frame.len > st.st_size - pos ||
+        crc32(map + pos, frame.len) != frame.crc)
+      break;
+
+    err = fn(map + pos, frame.len, arg);
+
+    if (err) {
+      count = -err;
+      break;
+    }
+
+    pos += frame.len;
+    ++count;
+  }
+
+  munmap((void*)map, st.st_size);
+  return count;
+}
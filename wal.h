@@ -0,0 +1,64 @@
+/**
+ * An interface for a write-ahead log with group commit.
+ *
+ * Records are appended to an in-memory batch under a short lock. A commit
+ * thread of the log takes the whole batch at once and writes it with a single
+ * `write` followed by `fdatasync`, so however many records came in while the
+ * previous batch was being synced share one sync. Appending never waits for
+ * the disk, those who need their record durable wait for it separately.
+ *
+ * Each record is framed with its length and a CRC-32, so that a torn write at
+ * the end of the log is recognised when it is read back.
+ */
+
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Wal Wal;
+
+/**
+ * Start a log in the empty file `fd`, which stays owned by the caller. A
+ * header goes first, so that `wal_replay` tells the file from any other.
+ * Returns NULL with errno set to EINVAL if the file is not empty, ENOMEM, the
+ * errno of writing the header or that of starting the commit thread.
+ */
+Wal* wal_open(int fd);
+
+/**
+ * Append a record of 1 to UINT32_MAX bytes. Returns its position in the log
+ * for `wal_wait`. Without memory for it the log fails like on a failed write:
+ * the record and all the ones after it are dropped, so that the file stays a
+ * prefix of what was appended, and `wal_wait` returns ENOMEM.
+ */
+uint64_t wal_append(Wal* wal, const void* rec, size_t len);
+
+/**
+ * Wait until everything up to the position `wal_append` returned is on disk.
+ * Returns 0, or the errno of an append, write or sync that failed since the
+ * log was opened, in which case it may not be.
+ */
+int wal_wait(Wal* wal, uint64_t pos);
+
+/** Commit whatever is left, stop the commit thread and free the log. Returns
+ * like `wal_wait`. */
+int wal_close(Wal* wal);
+
+/**
+ * Call `fn` on each record of a log file from its beginning, up to the first
+ * one that is cut short or damaged. A nonzero errno from `fn` stops it.
+ * Returns the number of records `fn` took, or minus that errno, -EINVAL if the
+ * file is not a log or minus the errno of reading the file.
+ */
+long wal_replay(int fd, int fn(const void* rec, size_t len, void* arg),
+                void* arg);
+
+/**
+ * Write all of `len` bytes to `fd`, going on after short writes and EINTR.
+ * Returns 0 or an errno. Also what `tree_save` writes its images with.
+ */
+int write_all(int fd, const void* data, size_t len);
+
+#endif  /* _WAL_H_ */